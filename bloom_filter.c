@@ -1,23 +1,256 @@
+#define _GNU_SOURCE  // CPU affinity for the NUMA mode
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
 #include <openssl/md5.h>
+#include "hash_engines.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 /*
- * For baller performance, use:
+ * Filter size and hash count are picked at runtime (see --size, --hashes,
+ * --items/--fpr, --memory and --preset). These are the defaults.
+ * For baller performance, use --preset high-accuracy:
  * BLOOM_SIZE 481221388
  # HASH_COUNT 23
  */
 
-#define BLOOM_SIZE 206237738
-#define HASH_COUNT 10
-#define MAX_LINE_LENGTH 256
-#define HASH_TABLE_SIZE 16777216  // 2^24
+#define DEFAULT_BLOOM_SIZE 206237738
+#define DEFAULT_HASH_COUNT 10
+#define MAX_HASH_COUNT 32
+#define MAX_BLOOM_SIZE (1ULL << 56)  // cells; far more than memory, and byte counts can't wrap
+#define WORD_SHARDS 64            // independently locked pieces of the exact-match set
+#define WORD_GROUP 16             // slots per probe group, one SSE2 compare
+#define BLOCK_BITS 512            // one 64-byte cache line
+#define SPLIT_BLOCK_BITS 256      // eight 32-bit lanes
+
+/*
+ * How the hash_count bit indexes are derived from a key:
+ * PROBE_SEEDED   - one full hash per probe, seeded with the probe number (the original way)
+ * PROBE_DOUBLE   - one 128-bit digest per key, index i = h1 + i*h2 (Kirsch-Mitzenmacher)
+ * PROBE_ENHANCED - same digest, enhanced double hashing (h1 += h2; h2 += i)
+ */
+typedef enum {
+	PROBE_SEEDED,
+	PROBE_DOUBLE,
+	PROBE_ENHANCED
+} ProbeScheme;
+
+/*
+ * Where a key's bits go:
+ * LAYOUT_CLASSIC  - anywhere in the array, up to hash_count cache misses per lookup
+ * LAYOUT_BLOCKED  - all inside one 64-byte block picked by the key, one miss per lookup
+ * LAYOUT_REGISTER - all inside one 64-bit word, one load and a mask compare
+ * LAYOUT_SPLIT    - split block: a 256-bit block of eight 32-bit lanes, one bit per lane
+ *                   (always 8 bits per key, hash_count is ignored), done with SIMD
+ * LAYOUT_COUNTING - classic probing, but each cell is a 4-bit counter so keys can be
+ *                   removed again; counters stick at 15 once they saturate
+ * The blocked layouts always hash the key once (the probe scheme only applies to classic).
+ */
+typedef enum {
+	LAYOUT_CLASSIC,
+	LAYOUT_BLOCKED,
+	LAYOUT_REGISTER,
+	LAYOUT_SPLIT,
+	LAYOUT_COUNTING
+} Layout;
+
+/*
+ * What the filter arrays get mapped with (--pages). Every random probe into
+ * a big array is a TLB miss on 4K pages; one 2M page covers 512 of them.
+ * PAGES_DEFAULT - plain 4K pages
+ * PAGES_THP     - transparent huge pages, asked for with madvise
+ * PAGES_HUGE_2M - explicit 2M hugetlbfs pages (needs vm.nr_hugepages)
+ * PAGES_HUGE_1G - explicit 1G hugetlbfs pages
+ * Anything that isn't available falls back down the list.
+ */
+typedef enum {
+	PAGES_DEFAULT,
+	PAGES_THP,
+	PAGES_HUGE_2M,
+	PAGES_HUGE_1G
+} PagePolicy;
+
+/*
+ * Where the filter lives on a multi-socket box when queries run on several
+ * threads (--numa):
+ * NUMA_OFF        - wherever the kernel put it (usually the node that built it)
+ * NUMA_REPLICATE  - a read-only copy on every node, and each query thread is
+ *                   pinned to one node and reads that node's copy
+ * NUMA_INTERLEAVE - one copy spread page by page over all nodes, for when
+ *                   there isn't memory for a copy per node
+ */
+typedef enum {
+	NUMA_OFF,
+	NUMA_REPLICATE,
+	NUMA_INTERLEAVE
+} NumaMode;
+
+/*
+ * What the queries print (--output):
+ * OUTPUT_TEXT      - maybe/no, one line per input line (the original output)
+ * OUTPUT_BITSET    - one bit per input line, 1 = maybe, lowest bit of each byte first
+ * OUTPUT_COUNTS    - just the number of lines, maybes and nos at the end
+ * OUTPUT_POSITIVES - line number (from 1), a tab and the word, for every maybe
+ */
+typedef enum {
+	OUTPUT_TEXT,
+	OUTPUT_BITSET,
+	OUTPUT_COUNTS,
+	OUTPUT_POSITIVES
+} OutputMode;
+
+/*
+ * Every engine produces 128 bits for (key, seed). The 64-bit ones stretch
+ * their result into the second word with a splitmix64 finalizer, which is
+ * plenty for double hashing since collisions on the first word are ~2^-64.
+ */
+typedef void (*HashFn)(const void *key, size_t len, uint32_t seed, uint64_t out[2]);
+
+typedef struct {
+	const char *name;
+	HashFn fn;
+} HashEngine;
+
+typedef struct {
+	const char *name;
+	void (*add)(uint32_t *block, uint32_t key);
+	int (*check)(const uint32_t *block, uint32_t key);
+} SplitKernel;
 
 typedef struct {
 	unsigned char *array;
+	uint64_t size;        // in bits
+	int hash_count;
+	ProbeScheme scheme;
+	Layout layout;
+	const HashEngine *engine;
+	const SplitKernel *split;
+	uint64_t items;
+	void *mapping;        // the mmapped filter file, or the anonymous mapping holding the array
+	size_t mapping_size;
+	PagePolicy pages;     // what the array actually got
 } BloomFilter;
 
+/*
+ * Scalable Bloom filter (Almeida et al.): a chain of stages, each with
+ * SCALABLE_GROWTH times the capacity of the one before and SCALABLE_TIGHTENING
+ * times its error rate, so the rates form a geometric series that stays under
+ * the target however many stages get added. Inserts go to the newest stage.
+ */
+#define MAX_STAGES 48
+
+typedef struct {
+	BloomFilter stages[MAX_STAGES];
+	int count;
+	uint64_t stage_items;  // what the newest stage was sized for
+	uint64_t stage_limit;  // items at which it passes SCALABLE_FILL and a new one starts
+	double stage_fpr;      // the newest stage's share of the error budget
+	double fpr;            // target for the whole chain
+	ProbeScheme scheme;
+	Layout layout;
+} ScalableFilter;
+
+/*
+ * Cuckoo filter (Fan et al.): each key keeps a small fingerprint in one of
+ * two 4-slot buckets. The second bucket is the first XORed with a hash of
+ * the fingerprint, so an entry can be moved without knowing its key.
+ * Fingerprints are 8 or 16 bits, one bucket is a 32- or 64-bit word.
+ */
+#define CUCKOO_SLOTS 4
+
+typedef struct {
+	void *table;
+	size_t table_size;         // mapped length
+	PagePolicy pages;
+	uint64_t buckets;          // power of two
+	int fingerprint_bits;      // 8 or 16
+	const HashEngine *engine;
+	uint64_t items;
+	uint64_t failed;           // inserts that didn't fit (these become false negatives)
+	uint64_t rng;              // picks which entry to kick out
+	int victim_used;           // the last entry kicked out when an insert ran out of kicks
+	uint64_t victim_bucket;
+	uint32_t victim_fingerprint;
+} CuckooFilter;
+
+/*
+ * Binary fuse filter (Graf and Lemire), the newer xor filter: an array of
+ * 8- or 16-bit fingerprints where the three slots a key hashes to XOR to its
+ * fingerprint. The slots come from three neighbouring segments, which is what
+ * lets the array be only ~1.13x the key count. It can't take keys one at a
+ * time: adds just collect key hashes, and fuse_build() makes the array once.
+ */
+typedef struct {
+	void *fingerprints;
+	size_t fingerprints_size;  // mapped length
+	PagePolicy pages;
+	int fingerprint_bits;      // 8 or 16
+	uint64_t seed;             // the one the build succeeded with
+	uint32_t segment_length;   // power of two
+	uint32_t segment_count_length;
+	uint32_t array_length;
+	const HashEngine *engine;
+	uint64_t *keys;            // key hashes collected before the build
+	size_t key_count;
+	size_t key_capacity;
+	uint64_t items;            // distinct keys in the built filter
+	uint64_t duplicates;
+	int attempts;              // seeds tried before the build worked
+} FuseFilter;
+
+/*
+ * What answers the membership queries:
+ * FILTER_BLOOM    - one Bloom filter sized up front (the original)
+ * FILTER_SCALABLE - a chain of Bloom filters that grows as items arrive
+ * FILTER_CUCKOO   - a cuckoo filter, smaller at low FPRs and keys can be removed
+ * FILTER_FUSE     - a binary fuse filter, built once from the whole key set
+ */
+typedef enum {
+	FILTER_BLOOM,
+	FILTER_SCALABLE,
+	FILTER_CUCKOO,
+	FILTER_FUSE
+} FilterKind;
+
+typedef struct {
+	FilterKind kind;
+	BloomFilter bloom;
+	ScalableFilter scalable;
+	CuckooFilter cuckoo;
+	FuseFilter fuse;
+} Filter;
+
+// A key is a view into the input, not a C string (the input is mmapped read-only)
+typedef struct {
+	const char *str;
+	size_t len;
+} Key;
+
 typedef struct {
 	int true_positive;
 	int true_negative;
@@ -25,150 +258,4170 @@ typedef struct {
 	int false_negative;
 } Results;
 
-typedef struct WordEntry {
-	char *word;
-	struct WordEntry *next;
-} WordEntry;
+/*
+ * Exact-match set: open addressing, Swiss table style. Each slot has a
+ * control byte holding 7 bits of its hash (or WORD_EMPTY), and lookups scan
+ * a group of 16 control bytes at once, so the string compare only happens
+ * on a tag match. The set is split into WORD_SHARDS shards by the top hash
+ * bits, each with its own lock, so build threads can insert in parallel.
+ * A removed word leaves WORD_DELETED behind so probes carry on past it.
+ */
+#define WORD_EMPTY 0x80
+#define WORD_DELETED 0xFE
+#define ARENA_SLAB_SIZE (4 << 20)
 
-WordEntry *hash_table[HASH_TABLE_SIZE] = {NULL};
+/*
+ * Word storage: strings are bump-allocated into 4 MB slabs as a 32-bit
+ * length followed by the bytes, instead of a malloc + strdup per word.
+ * Freeing the whole thing is one free() per slab.
+ */
+typedef struct ArenaSlab {
+	struct ArenaSlab *next;
+	size_t used;
+	size_t size;
+	char data[];
+} ArenaSlab;
 
-// Bloom filter functions
-void bloom_init(BloomFilter *filter) {
-	filter->array = calloc(BLOOM_SIZE / 8, 1);
-	if (filter->array == NULL) {
-		fprintf(stderr, "Failed to allocate memory for Bloom filter\n");
-		exit(1);
-	}
-}
+typedef struct {
+	ArenaSlab *head;
+	size_t slabs;
+	size_t bytes;    // bytes handed out, including length prefixes
+	size_t strings;
+} Arena;
 
-void bloom_free(BloomFilter *filter) {
-	free(filter->array);
-}
+typedef struct {
+	const char *word;  // length-prefixed record in the shard's arena
+	uint64_t hash;     // kept so resizing doesn't rehash the strings
+} WordSlot;
+
+typedef struct {
+	uint8_t *ctrl;
+	WordSlot *slots;
+	size_t capacity;  // power of two, at least WORD_GROUP
+	size_t count;
+	size_t deleted;   // WORD_DELETED slots, which still count towards the load
+	Arena arena;
+	pthread_mutex_t lock;
+} WordSet;
+
+WordSet word_sets[WORD_SHARDS];
 
-unsigned int hash(const unsigned char *str, unsigned int seed) {
+// Hash engines
+// MD5 of key || seed, exactly what the original hash() did
+void hash_md5(const void *key, size_t len, uint32_t seed, uint64_t out[2]) {
 	unsigned char digest[MD5_DIGEST_LENGTH];
 	MD5_CTX ctx;
 	MD5_Init(&ctx);
-	MD5_Update(&ctx, str, strlen((char *)str));
+	MD5_Update(&ctx, key, len);
 	MD5_Update(&ctx, &seed, sizeof(seed));
 	MD5_Final(digest, &ctx);
-	
-	return *(unsigned int*)digest;
+	memcpy(&out[0], digest, sizeof(out[0]));
+	memcpy(&out[1], digest + 8, sizeof(out[1]));
+}
+
+enum {
+	ENGINE_MD5,
+	ENGINE_XXH64,
+	ENGINE_MURMUR3,
+	ENGINE_WYHASH,
+	ENGINE_COUNT
+};
+
+static const HashEngine hash_engines[ENGINE_COUNT] = {
+	[ENGINE_MD5]     = {"md5", hash_md5},
+	[ENGINE_XXH64]   = {"xxh64", hash_xxh64},
+	[ENGINE_MURMUR3] = {"murmur3", hash_murmur3},
+	[ENGINE_WYHASH]  = {"wyhash", hash_wyhash},
+};
+
+// Engine used by the exact-match hash table; the filter carries its own
+const HashEngine *hash_engine = &hash_engines[ENGINE_MD5];
+
+const HashEngine *find_hash_engine(const char *name) {
+	for (int i = 0; i < ENGINE_COUNT; i++) {
+		if (strcmp(hash_engines[i].name, name) == 0) {
+			return &hash_engines[i];
+		}
+	}
+	return NULL;
 }
 
-void bloom_add(BloomFilter *filter, const char *str) {
-	for (int i = 0; i < HASH_COUNT; i++) {
-		unsigned int index = hash((unsigned char *)str, i) % BLOOM_SIZE;
-		filter->array[index / 8] |= 1 << (index % 8);
+/*
+ * Split block kernels. Each lane multiplies the 32-bit key hash by its own
+ * odd salt and uses the top 5 bits to pick its bit, so the whole insert or
+ * check is a broadcast, a multiply, a shift and an OR/test. The kernel is
+ * picked once with CPUID so the same binary runs everywhere.
+ */
+static const uint32_t split_salt[8] = {
+	0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+	0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+void split_add_scalar(uint32_t *block, uint32_t key) {
+	for (int i = 0; i < 8; i++) {
+		block[i] |= 1U << ((key * split_salt[i]) >> 27);
 	}
 }
 
-int bloom_check(BloomFilter *filter, const char *str) {
-	for (int i = 0; i < HASH_COUNT; i++) {
-		unsigned int index = hash((unsigned char *)str, i) % BLOOM_SIZE;
-		if (!(filter->array[index / 8] & (1 << (index % 8)))) {
+int split_check_scalar(const uint32_t *block, uint32_t key) {
+	for (int i = 0; i < 8; i++) {
+		if (!(block[i] & (1U << ((key * split_salt[i]) >> 27)))) {
 			return 0;
 		}
 	}
 	return 1;
 }
 
-// Hash table functions
-unsigned int hash_string(const char *str) {
-	unsigned char digest[MD5_DIGEST_LENGTH];
-	MD5((unsigned char*)str, strlen(str), digest);
-	return *(unsigned int*)digest % HASH_TABLE_SIZE;
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2")))
+static inline __m256i split_mask_avx2(uint32_t key) {
+	__m256i salt = _mm256_loadu_si256((const __m256i *)split_salt);
+	__m256i bits = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(key), salt), 27);
+	return _mm256_sllv_epi32(_mm256_set1_epi32(1), bits);
 }
 
-void add_word(const char *word) {
-	unsigned int index = hash_string(word);
-	WordEntry *new_entry = malloc(sizeof(WordEntry));
-	new_entry->word = strdup(word);
-	new_entry->next = hash_table[index];
-	hash_table[index] = new_entry;
+__attribute__((target("avx2")))
+void split_add_avx2(uint32_t *block, uint32_t key) {
+	__m256i *p = (__m256i *)block;
+	_mm256_store_si256(p, _mm256_or_si256(_mm256_load_si256(p), split_mask_avx2(key)));
 }
 
-int check_word(const char *word) {
-	unsigned int index = hash_string(word);
-	WordEntry *entry = hash_table[index];
-	while (entry != NULL) {
-		if (strcmp(entry->word, word) == 0) {
-			return 1;
+__attribute__((target("avx2")))
+int split_check_avx2(const uint32_t *block, uint32_t key) {
+	return _mm256_testc_si256(_mm256_load_si256((const __m256i *)block), split_mask_avx2(key));
+}
+
+// AVX-512VL: the mask gets built with a rotate instead of a shift and the
+// compare lands in a mask register, which saves a couple of uops per check
+__attribute__((target("avx512f,avx512vl")))
+static inline __m256i split_mask_avx512(uint32_t key) {
+	__m256i salt = _mm256_loadu_si256((const __m256i *)split_salt);
+	__m256i bits = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(key), salt), 27);
+	return _mm256_rolv_epi32(_mm256_set1_epi32(1), bits);
+}
+
+__attribute__((target("avx512f,avx512vl")))
+void split_add_avx512(uint32_t *block, uint32_t key) {
+	__m256i *p = (__m256i *)block;
+	_mm256_store_si256(p, _mm256_or_si256(_mm256_load_si256(p), split_mask_avx512(key)));
+}
+
+__attribute__((target("avx512f,avx512vl")))
+int split_check_avx512(const uint32_t *block, uint32_t key) {
+	// Every lane of the mask has exactly one bit, so any lane testing zero is a miss
+	return _mm256_testn_epi32_mask(_mm256_load_si256((const __m256i *)block), split_mask_avx512(key)) == 0;
+}
+#endif
+
+const SplitKernel *split_kernel(void) {
+	static const SplitKernel scalar = {"scalar", split_add_scalar, split_check_scalar};
+#ifdef HAVE_X86_SIMD
+	static const SplitKernel avx2 = {"avx2", split_add_avx2, split_check_avx2};
+	static const SplitKernel avx512 = {"avx512", split_add_avx512, split_check_avx512};
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")) {
+		return &avx512;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		return &avx2;
+	}
+#endif
+	return &scalar;
+}
+
+// Page allocation
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define HUGE_2M (2UL << 20)
+#define HUGE_1G (1UL << 30)
+
+PagePolicy page_policy = PAGES_DEFAULT;  // --pages
+int page_prefault = 0;                   // --prefault: fault every page in up front
+
+static const char *page_names[] = {"4K", "THP", "2M hugetlb", "1G hugetlb"};
+
+// Whether THP is switched off altogether (enabled is "always", "madvise" or "never")
+static int thp_disabled(void) {
+	char mode[64] = "";
+	FILE *file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+	if (file == NULL) {
+		return 1;
+	}
+	if (fgets(mode, sizeof(mode), file) == NULL) {
+		mode[0] = '\0';
+	}
+	fclose(file);
+	return strstr(mode, "[never]") != NULL || mode[0] == '\0';
+}
+
+static void *map_anonymous(size_t size, int flags) {
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+	return map == MAP_FAILED ? NULL : map;
+}
+
+/*
+ * THP needs the range 2M aligned, so map 2M extra and trim both ends.
+ * Returns NULL if the kernel won't do THP, so the caller can fall back.
+ */
+static void *map_thp(size_t size) {
+	if (thp_disabled()) {
+		return NULL;
+	}
+	char *map = map_anonymous(size + HUGE_2M, 0);
+	if (map == NULL) {
+		return NULL;
+	}
+	char *start = (char *)(((uintptr_t)map + HUGE_2M - 1) & ~(uintptr_t)(HUGE_2M - 1));
+	if (start > map) {
+		munmap(map, start - map);
+	}
+	munmap(start + size, map + size + HUGE_2M - (start + size));
+	if (madvise(start, size, MADV_HUGEPAGE) != 0) {
+		munmap(start, size);
+		return NULL;
+	}
+	return start;
+}
+
+/*
+ * Zeroed memory for a filter array, mapped according to page_policy. Each
+ * policy falls back to the next smaller one when it can't be had (no
+ * hugetlbfs pages reserved, THP off, or the array is too small for the page
+ * size to make sense). *mapped gets the length to hand to page_free() and
+ * *pages what it ended up with.
+ */
+void *page_alloc(size_t bytes, size_t *mapped, PagePolicy *pages) {
+	int populate = page_prefault ? MAP_POPULATE : 0;
+	void *map = NULL;
+	PagePolicy policy = page_policy;
+
+	if (policy == PAGES_HUGE_1G) {
+		if (bytes >= HUGE_1G / 2) {
+			*mapped = (bytes + HUGE_1G - 1) & ~(HUGE_1G - 1);
+			map = map_anonymous(*mapped, MAP_HUGETLB | (30 << MAP_HUGE_SHIFT) | populate);
 		}
-		entry = entry->next;
+		if (map == NULL) policy = PAGES_HUGE_2M;
 	}
-	return 0;
+	if (map == NULL && policy == PAGES_HUGE_2M) {
+		if (bytes >= HUGE_2M / 2) {
+			*mapped = (bytes + HUGE_2M - 1) & ~(HUGE_2M - 1);
+			map = map_anonymous(*mapped, MAP_HUGETLB | (21 << MAP_HUGE_SHIFT) | populate);
+		}
+		if (map == NULL) policy = PAGES_THP;
+	}
+	if (map == NULL && policy == PAGES_THP) {
+		if (bytes >= HUGE_2M) {
+			*mapped = (bytes + HUGE_2M - 1) & ~(HUGE_2M - 1);
+			map = map_thp(*mapped);
+		}
+		// MAP_POPULATE would have faulted in 4K pages before the madvise, so prefault now
+		if (map != NULL && page_prefault) {
+#ifdef MADV_POPULATE_WRITE
+			if (madvise(map, *mapped, MADV_POPULATE_WRITE) != 0)
+#endif
+				for (size_t i = 0; i < *mapped; i += 4096) ((volatile char *)map)[i] = 0;
+		}
+		if (map == NULL) policy = PAGES_DEFAULT;
+	}
+	if (map == NULL) {
+		*mapped = (bytes + 4095) & ~(size_t)4095;
+		if (*mapped == 0) *mapped = 4096;
+		map = map_anonymous(*mapped, populate);
+	}
+	if (map == NULL) {
+		fprintf(stderr, "Failed to allocate memory for filter\n");
+		exit(1);
+	}
+	*pages = policy;
+	return map;
+}
+
+void page_free(void *ptr, size_t mapped) {
+	if (ptr != NULL) {
+		munmap(ptr, mapped);
+	}
+}
+
+// ", 2M hugetlb pages" or ", 4K pages (wanted THP)" and so on, for the reports
+void page_report(PagePolicy pages) {
+	fprintf(stderr, ", %s pages", page_names[pages]);
+	if (pages != page_policy) {
+		fprintf(stderr, " (wanted %s)", page_names[page_policy]);
+	}
+	if (page_prefault) {
+		fprintf(stderr, ", prefaulted");
+	}
+}
+
+// Bloom filter functions
+static inline uint64_t bloom_cell_bits(Layout layout) {
+	return layout == LAYOUT_COUNTING ? 4 : 1;
+}
+
+/*
+ * Size of the array, rounded up to whole cache lines so blocks never straddle
+ * two of them. Divides before multiplying so no size up to MAX_BLOOM_SIZE wraps.
+ */
+size_t bloom_bytes(uint64_t size, Layout layout) {
+	uint64_t cell_bits = bloom_cell_bits(layout);
+	return (size / 8 * cell_bits + size % 8 * cell_bits / 8 + 1 + 63) & ~(size_t)63;
+}
+
+/*
+ * size is in cells (bits, or counters for LAYOUT_COUNTING); it has to hold at
+ * least one block for the blocked layouts, and at most MAX_BLOOM_SIZE
+ */
+void bloom_init(BloomFilter *filter, uint64_t size, int hash_count, Layout layout) {
+	if (size > MAX_BLOOM_SIZE) {
+		fprintf(stderr, "Filter size %llu is too big (at most %llu cells)\n", (unsigned long long)size,
+			(unsigned long long)MAX_BLOOM_SIZE);
+		exit(1);
+	}
+	filter->array = page_alloc(bloom_bytes(size, layout), &filter->mapping_size, &filter->pages);
+	filter->mapping = filter->array;
+	filter->size = size;
+	filter->hash_count = hash_count;
+	filter->scheme = PROBE_SEEDED;
+	filter->layout = layout;
+	filter->engine = hash_engine;
+	filter->split = split_kernel();
+	filter->items = 0;
+}
+
+void bloom_free(BloomFilter *filter) {
+	munmap(filter->mapping, filter->mapping_size);
 }
 
-void free_hash_table() {
-	for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-		WordEntry *entry = hash_table[i];
-		while (entry != NULL) {
-			WordEntry *temp = entry;
-			entry = entry->next;
-			free(temp->word);
-			free(temp);
+/*
+ * Maps a 64-bit hash onto [0, n) with a multiply and a shift instead of a
+ * division (Lemire's fastrange). When n is a power of two this is just the
+ * top bits of the hash, so there's no need for a separate mask path.
+ */
+static inline uint64_t fastrange64(uint64_t h, uint64_t n) {
+	return (uint64_t)(((__uint128_t)h * n) >> 64);
+}
+
+// Fills indexes[0..hash_count) with the bit positions for str
+void bloom_indexes(const BloomFilter *filter, const char *str, size_t len, uint64_t *indexes) {
+	if (filter->scheme == PROBE_SEEDED) {
+		for (int i = 0; i < filter->hash_count; i++) {
+			uint64_t out[2];
+			filter->engine->fn(str, len, i, out);
+			indexes[i] = fastrange64(out[0], filter->size);
 		}
+		return;
+	}
+
+	uint64_t h[2];
+	filter->engine->fn(str, len, 0, h);
+	uint64_t h1 = h[0], h2 = h[1];
+	if (filter->scheme == PROBE_DOUBLE) {
+		for (int i = 0; i < filter->hash_count; i++) {
+			indexes[i] = fastrange64(h1, filter->size);
+			h1 += h2;
+		}
+		return;
+	}
+
+	/*
+	 * Enhanced: h2 += i never reaches the top bits fastrange64() reads, so the
+	 * recurrence runs on h1 and h2 reduced into [0, size) instead, wrapping
+	 * with a compare and subtract (i < size, so one subtract is enough).
+	 */
+	h1 = fastrange64(h1, filter->size);
+	h2 = fastrange64(h2, filter->size);
+	for (int i = 0; i < filter->hash_count; i++) {
+		indexes[i] = h1;
+		h1 += h2;
+		if (h1 >= filter->size) h1 -= filter->size;
+		h2 += i;
+		if (h2 >= filter->size) h2 -= filter->size;
 	}
 }
 
-// Main function
-int main() {
-	BloomFilter filter;
-	bloom_init(&filter);
-	Results results = {0};
+/*
+ * Blocked layouts: the first hash word picks the block (or word), and the
+ * bits inside it come off the top of the second word, remultiplied by an odd
+ * constant for each probe. (Double hashing inside a block only has a few
+ * thousand distinct patterns, which shows up as extra false positives.)
+ * Only whole blocks that fit in the filter size are used, so memory is the same.
+ */
+#define BLOCK_MULT 0x9E3779B97F4A7C15ULL
 
-	// Load rockyou.txt into Bloom filter and hash table
-	FILE *rockyou = fopen("rockyou.ISO-8859-1.txt", "r");
-	if (rockyou == NULL) {
-		fprintf(stderr, "Failed to open rockyou.ISO-8859-1.txt\n");
-		return 1;
+static inline uint64_t register_mask(uint64_t x, int hash_count) {
+	uint64_t mask = 0;
+	for (int i = 0; i < hash_count; i++) {
+		mask |= 1ULL << (x >> 58);
+		x *= BLOCK_MULT;
+	}
+	return mask;
+}
+
+static inline uint64_t *register_word(const BloomFilter *filter, uint64_t h) {
+	return (uint64_t *)filter->array + fastrange64(h, filter->size / 64);
+}
+
+static inline uint64_t *blocked_block(const BloomFilter *filter, uint64_t h) {
+	return (uint64_t *)filter->array + fastrange64(h, filter->size / BLOCK_BITS) * (BLOCK_BITS / 64);
+}
+
+static inline uint32_t *split_block(const BloomFilter *filter, uint64_t h) {
+	return (uint32_t *)filter->array + fastrange64(h, filter->size / SPLIT_BLOCK_BITS) * 8;
+}
+
+// Everything a lookup needs once the key has been hashed
+typedef struct {
+	uint64_t h[2];                 // blocked layouts
+	uint64_t indexes[MAX_HASH_COUNT];  // classic layout
+} BloomProbe;
+
+void bloom_hash(const BloomFilter *filter, const char *str, size_t len, BloomProbe *probe) {
+	if (filter->layout == LAYOUT_CLASSIC || filter->layout == LAYOUT_COUNTING) {
+		bloom_indexes(filter, str, len, probe->indexes);
+	} else {
+		filter->engine->fn(str, len, 0, probe->h);
 	}
+}
 
-	char line[MAX_LINE_LENGTH];
-	while (fgets(line, sizeof(line), rockyou)) {
-		line[strcspn(line, "\n")] = 0;
-		bloom_add(&filter, line);
-		add_word(line);
+// Starts pulling in every cache line the probe will touch
+void bloom_prefetch(const BloomFilter *filter, const BloomProbe *probe) {
+	switch (filter->layout) {
+	case LAYOUT_CLASSIC:
+		for (int i = 0; i < filter->hash_count; i++) {
+			__builtin_prefetch(&filter->array[probe->indexes[i] / 8]);
+		}
+		break;
+	case LAYOUT_BLOCKED:
+		__builtin_prefetch(blocked_block(filter, probe->h[0]));
+		break;
+	case LAYOUT_REGISTER:
+		__builtin_prefetch(register_word(filter, probe->h[0]));
+		break;
+	case LAYOUT_SPLIT:
+		__builtin_prefetch(split_block(filter, probe->h[0]));
+		break;
+	case LAYOUT_COUNTING:
+		for (int i = 0; i < filter->hash_count; i++) {
+			__builtin_prefetch(&filter->array[probe->indexes[i] / 2]);
+		}
+		break;
 	}
-	fclose(rockyou);
+}
 
-	// Process dictionary.txt
-	FILE *dictionary = fopen("dictionary.txt", "r");
-	if (dictionary == NULL) {
-		fprintf(stderr, "Failed to open dictionary.txt\n");
-		bloom_free(&filter);
-		free_hash_table();
+/*
+ * Counting layout: counter i is the low nibble of byte i/2 for even i and the
+ * high nibble for odd i. A counter that reaches 15 might have been bumped by
+ * more keys than it can count, so it is never decremented again.
+ */
+#define COUNTER_MAX 15
+
+static inline unsigned counter_get(const unsigned char *array, uint64_t i) {
+	return (array[i / 2] >> (i % 2 * 4)) & 0xf;
+}
+
+static inline void counter_inc(unsigned char *array, uint64_t i) {
+	if (counter_get(array, i) < COUNTER_MAX) {
+		array[i / 2] += 1 << (i % 2 * 4);
+	}
+}
+
+static inline void counter_dec(unsigned char *array, uint64_t i) {
+	unsigned count = counter_get(array, i);
+	if (count > 0 && count < COUNTER_MAX) {
+		array[i / 2] -= 1 << (i % 2 * 4);
+	}
+}
+
+// counter_inc() for the parallel build: retries if another thread changed the byte first
+static inline void counter_inc_atomic(unsigned char *array, uint64_t i) {
+	unsigned char old = __atomic_load_n(&array[i / 2], __ATOMIC_RELAXED);
+	unsigned char updated;
+	do {
+		if (((old >> (i % 2 * 4)) & 0xf) == COUNTER_MAX) {
+			return;
+		}
+		updated = old + (1 << (i % 2 * 4));
+	} while (!__atomic_compare_exchange_n(&array[i / 2], &old, updated, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void bloom_set(BloomFilter *filter, const BloomProbe *probe) {
+	uint64_t x = probe->h[1];
+	uint64_t *block;
+
+	switch (filter->layout) {
+	case LAYOUT_CLASSIC:
+		for (int i = 0; i < filter->hash_count; i++) {
+			filter->array[probe->indexes[i] / 8] |= 1 << (probe->indexes[i] % 8);
+		}
+		break;
+	case LAYOUT_BLOCKED:
+		block = blocked_block(filter, probe->h[0]);
+		for (int i = 0; i < filter->hash_count; i++) {
+			uint32_t bit = x >> 55;
+			block[bit / 64] |= 1ULL << (bit % 64);
+			x *= BLOCK_MULT;
+		}
+		break;
+	case LAYOUT_REGISTER:
+		*register_word(filter, probe->h[0]) |= register_mask(x, filter->hash_count);
+		break;
+	case LAYOUT_SPLIT:
+		filter->split->add(split_block(filter, probe->h[0]), (uint32_t)x);
+		break;
+	case LAYOUT_COUNTING:
+		for (int i = 0; i < filter->hash_count; i++) {
+			counter_inc(filter->array, probe->indexes[i]);
+		}
+		break;
+	}
+}
+
+// Same bits as bloom_set(), but safe to call from several threads at once
+void bloom_set_atomic(BloomFilter *filter, const BloomProbe *probe) {
+	uint64_t x = probe->h[1];
+	uint64_t *block;
+	uint32_t *lanes;
+
+	switch (filter->layout) {
+	case LAYOUT_CLASSIC:
+		for (int i = 0; i < filter->hash_count; i++) {
+			__atomic_fetch_or(&filter->array[probe->indexes[i] / 8],
+				(unsigned char)(1 << (probe->indexes[i] % 8)), __ATOMIC_RELAXED);
+		}
+		break;
+	case LAYOUT_BLOCKED:
+		block = blocked_block(filter, probe->h[0]);
+		for (int i = 0; i < filter->hash_count; i++) {
+			uint32_t bit = x >> 55;
+			__atomic_fetch_or(&block[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELAXED);
+			x *= BLOCK_MULT;
+		}
+		break;
+	case LAYOUT_REGISTER:
+		__atomic_fetch_or(register_word(filter, probe->h[0]), register_mask(x, filter->hash_count), __ATOMIC_RELAXED);
+		break;
+	case LAYOUT_SPLIT:
+		lanes = split_block(filter, probe->h[0]);
+		for (int i = 0; i < 8; i++) {
+			__atomic_fetch_or(&lanes[i], 1U << (((uint32_t)x * split_salt[i]) >> 27), __ATOMIC_RELAXED);
+		}
+		break;
+	case LAYOUT_COUNTING:
+		for (int i = 0; i < filter->hash_count; i++) {
+			counter_inc_atomic(filter->array, probe->indexes[i]);
+		}
+		break;
+	}
+}
+
+int bloom_test(const BloomFilter *filter, const BloomProbe *probe) {
+	uint64_t x = probe->h[1];
+
+	switch (filter->layout) {
+	case LAYOUT_CLASSIC:
+		for (int i = 0; i < filter->hash_count; i++) {
+			if (!(filter->array[probe->indexes[i] / 8] & (1 << (probe->indexes[i] % 8)))) {
+				return 0;
+			}
+		}
 		return 1;
+	case LAYOUT_BLOCKED: {
+		uint64_t mask[BLOCK_BITS / 64] = {0};
+		for (int i = 0; i < filter->hash_count; i++) {
+			uint32_t bit = x >> 55;
+			mask[bit / 64] |= 1ULL << (bit % 64);
+			x *= BLOCK_MULT;
+		}
+		const uint64_t *block = blocked_block(filter, probe->h[0]);
+		uint64_t missing = 0;
+		for (int i = 0; i < BLOCK_BITS / 64; i++) {
+			missing |= mask[i] & ~block[i];
+		}
+		return missing == 0;
+	}
+	case LAYOUT_REGISTER: {
+		uint64_t mask = register_mask(x, filter->hash_count);
+		return (*register_word(filter, probe->h[0]) & mask) == mask;
+	}
+	case LAYOUT_SPLIT:
+		return filter->split->check(split_block(filter, probe->h[0]), (uint32_t)x);
+	case LAYOUT_COUNTING:
+		for (int i = 0; i < filter->hash_count; i++) {
+			if (counter_get(filter->array, probe->indexes[i]) == 0) {
+				return 0;
+			}
+		}
+		return 1;
+	}
+	return 0;
+}
+
+void bloom_add(BloomFilter *filter, const char *str, size_t len) {
+	BloomProbe probe;
+	bloom_hash(filter, str, len, &probe);
+	bloom_set(filter, &probe);
+	filter->items++;
+}
+
+int bloom_check(BloomFilter *filter, const char *str, size_t len) {
+	BloomProbe probe;
+	bloom_hash(filter, str, len, &probe);
+	return bloom_test(filter, &probe);
+}
+
+/*
+ * Takes a key back out of a counting filter. Returns 1 if it was removed,
+ * 0 if the filter says it was never there (decrementing anyway would cause
+ * false negatives for other keys), and -1 if the layout can't remove.
+ */
+int bloom_remove(BloomFilter *filter, const char *str, size_t len) {
+	if (filter->layout != LAYOUT_COUNTING) {
+		return -1;
 	}
+	BloomProbe probe;
+	bloom_hash(filter, str, len, &probe);
+	if (!bloom_test(filter, &probe)) {
+		return 0;
+	}
+	for (int i = 0; i < filter->hash_count; i++) {
+		counter_dec(filter->array, probe.indexes[i]);
+	}
+	if (filter->items > 0) {
+		filter->items--;
+	}
+	return 1;
+}
 
-	while (fgets(line, sizeof(line), dictionary)) {
-		line[strcspn(line, "\n")] = 0;
-		int bloom_result = bloom_check(&filter, line);
-		int actual_present = check_word(line);
+/*
+ * Checks keys[0..n) into results[0..n). Keys go through in windows of
+ * batch_window: hash the whole window and prefetch everything it will touch,
+ * then go back and test the bits, so the DRAM misses of different keys
+ * overlap instead of happening one after another.
+ */
+#define MAX_BATCH_WINDOW 256
 
-		if (bloom_result) {
-			printf("maybe\n");
-			if (actual_present) results.true_positive++;
-			else results.false_positive++;
-		} else {
-			printf("no\n");
-			if (actual_present) results.false_negative++;
-			else results.true_negative++;
+int batch_window = 16;
+
+void bloom_check_batch(BloomFilter *filter, const Key *keys, size_t n, int *results) {
+	BloomProbe probes[MAX_BATCH_WINDOW];
+
+	for (size_t start = 0; start < n; start += batch_window) {
+		size_t count = n - start < (size_t)batch_window ? n - start : (size_t)batch_window;
+		for (size_t i = 0; i < count; i++) {
+			bloom_hash(filter, keys[start + i].str, keys[start + i].len, &probes[i]);
+			bloom_prefetch(filter, &probes[i]);
+		}
+		for (size_t i = 0; i < count; i++) {
+			results[start + i] = bloom_test(filter, &probes[i]);
 		}
 	}
-	fclose(dictionary);
+}
 
-	// Print statistics
-	printf("True Positives: %d\n", results.true_positive);
-	printf("True Negatives: %d\n", results.true_negative);
-	printf("False Positives: %d\n", results.false_positive);
-	printf("False Negatives: %d\n", results.false_negative);
+/*
+ * Theoretical FPR after n inserts. Classic is the usual (1 - e^(-kn/m))^k.
+ * For the blocked layouts each block gets a Poisson(n / blocks) number of
+ * keys, and a lookup is a classic filter of block_bits bits with that load,
+ * so the overall rate is the Poisson-weighted average of those. A split
+ * block is the same thing with eight 32-bit filters that each take one bit.
+ */
+double bloom_expected_fpr(const BloomFilter *filter, Layout layout, double n) {
+	double k = filter->hash_count;
+	double m = filter->size;
+	if (layout == LAYOUT_CLASSIC || layout == LAYOUT_COUNTING) {
+		return pow(1 - exp(-k * n / m), k);
+	}
 
-	// Clean up! Clean up! Everybody, Everywhere!
-	// Clean up! Clean up! Everybody do your share!
-	bloom_free(&filter);
-	free_hash_table();
+	double block_bits = layout == LAYOUT_REGISTER ? 64 : BLOCK_BITS;
+	double lambda_bits = block_bits;
+	if (layout == LAYOUT_SPLIT) {
+		block_bits = 32;
+		lambda_bits = SPLIT_BLOCK_BITS;
+		k = 8;
+	}
+	double lambda = n / floor(m / lambda_bits);
+	// Only loads within ~10 standard deviations of the mean matter
+	int first = (int)fmax(0, lambda - 10 * sqrt(lambda) - 20);
+	int limit = (int)(lambda + 10 * sqrt(lambda) + 20);
+	double fpr = 0;
+	for (int i = first; i <= limit; i++) {
+		// Poisson pmf in log space so big loads don't underflow exp(-lambda)
+		double p = exp(i * log(lambda) - lambda - lgamma(i + 1));
+		double bits_per_word = layout == LAYOUT_SPLIT ? i : i * k;
+		fpr += p * pow(1 - pow(1 - 1 / block_bits, bits_per_word), k);
+	}
+	return fpr;
+}
+
+void bloom_report(const BloomFilter *filter) {
+	static const char *names[] = {"classic", "blocked", "register", "split", "counting"};
+	double classic = bloom_expected_fpr(filter, LAYOUT_CLASSIC, filter->items);
+	fprintf(stderr, "Layout: %s, %llu %s, k=%d, %llu items, expected FPR %.3g",
+		names[filter->layout], (unsigned long long)filter->size,
+		filter->layout == LAYOUT_COUNTING ? "counters" : "bits", filter->hash_count,
+		(unsigned long long)filter->items,
+		bloom_expected_fpr(filter, filter->layout, filter->items));
+	if (filter->layout == LAYOUT_COUNTING) {
+		uint64_t saturated = 0;
+		for (uint64_t i = 0; i < filter->size; i++) {
+			saturated += counter_get(filter->array, i) == COUNTER_MAX;
+		}
+		fprintf(stderr, ", %.2fx the memory of a plain filter, %llu saturated counters",
+			(double)bloom_bytes(filter->size, LAYOUT_COUNTING) / bloom_bytes(filter->size, LAYOUT_CLASSIC),
+			(unsigned long long)saturated);
+	} else if (filter->layout != LAYOUT_CLASSIC) {
+		fprintf(stderr, " (classic %.3g, %.2fx penalty)", classic,
+			classic > 0 ? bloom_expected_fpr(filter, filter->layout, filter->items) / classic : 1.0);
+	}
+	if (filter->layout == LAYOUT_SPLIT) {
+		fprintf(stderr, ", %s kernel", filter->split->name);
+	}
+	if (filter->mapping == filter->array) {
+		page_report(filter->pages);
+	}
+	fprintf(stderr, "\n");
+}
+
+// Scalable filter functions
+#define SCALABLE_GROWTH 2
+#define SCALABLE_TIGHTENING 0.85
+#define SCALABLE_FILL 0.5         // fraction of a stage's bits set before it counts as full
+#define SCALABLE_DEFAULT_ITEMS (1 << 20)
+#define SCALABLE_DEFAULT_FPR 0.001
+
+/*
+ * Adds a stage sized for stage_items at stage_fpr, starting from the textbook
+ * optimal m and k. The blocked layouts do worse than that at the same m, so
+ * their stages grow until bloom_expected_fpr() for the layout meets the
+ * target. The fill of a stage is estimated from its item count,
+ * 1 - e^(-kn/m), which at the optimal k reaches one half right at capacity;
+ * a stage never takes more than stage_items, which is what it was sized for.
+ */
+void scalable_grow(ScalableFilter *sf) {
+	if (sf->count == MAX_STAGES) {
+		fprintf(stderr, "Scalable filter ran out of stages\n");
+		exit(1);
+	}
+	double n = sf->stage_items;
+	uint64_t size = (uint64_t)ceil(-n * log(sf->stage_fpr) / (M_LN2 * M_LN2));
+	int hash_count = (int)round((double)size / n * M_LN2);
+	if (hash_count < 1) hash_count = 1;
+	if (hash_count > MAX_HASH_COUNT) hash_count = MAX_HASH_COUNT;
+	if (size < BLOCK_BITS) size = BLOCK_BITS;
+	BloomFilter sizing = {.size = size, .hash_count = hash_count};
+	while (bloom_expected_fpr(&sizing, sf->layout, n) > sf->stage_fpr && sizing.size < size * 64) {
+		sizing.size += sizing.size / 16;
+	}
+	size = sizing.size;
+
+	BloomFilter *stage = &sf->stages[sf->count++];
+	bloom_init(stage, size, hash_count, sf->layout);
+	stage->scheme = sf->scheme;
+	int bits_per_key = sf->layout == LAYOUT_SPLIT ? 8 : hash_count;
+	sf->stage_limit = (uint64_t)(-(double)size * log(1 - SCALABLE_FILL) / bits_per_key);
+	if (sf->stage_limit > sf->stage_items) {
+		sf->stage_limit = sf->stage_items;
+	}
+}
+
+// items and fpr are the first stage's capacity and the target for the whole chain
+void scalable_init(ScalableFilter *sf, uint64_t items, double fpr, ProbeScheme scheme, Layout layout) {
+	sf->count = 0;
+	sf->stage_items = items;
+	sf->stage_fpr = fpr * (1 - SCALABLE_TIGHTENING);
+	sf->fpr = fpr;
+	sf->scheme = scheme;
+	sf->layout = layout;
+	scalable_grow(sf);
+}
+
+void scalable_free(ScalableFilter *sf) {
+	for (int i = 0; i < sf->count; i++) {
+		bloom_free(&sf->stages[i]);
+	}
+	sf->count = 0;
+}
+
+void scalable_add(ScalableFilter *sf, const char *str, size_t len) {
+	if (sf->stages[sf->count - 1].items >= sf->stage_limit) {
+		sf->stage_items *= SCALABLE_GROWTH;
+		sf->stage_fpr *= SCALABLE_TIGHTENING;
+		scalable_grow(sf);
+	}
+	bloom_add(&sf->stages[sf->count - 1], str, len);
+}
+
+/*
+ * Checks the stages newest first, since the newest is the biggest and holds
+ * the most keys. Each stage only sees the keys no newer stage claimed, still
+ * in one batch so the prefetching keeps working.
+ */
+void scalable_check_batch(ScalableFilter *sf, const Key *keys, size_t n, int *results) {
+	Key pending[MAX_BATCH_WINDOW];
+	size_t where[MAX_BATCH_WINDOW];
+	int hits[MAX_BATCH_WINDOW];
+
+	for (size_t start = 0; start < n; start += MAX_BATCH_WINDOW) {
+		size_t left = n - start < MAX_BATCH_WINDOW ? n - start : MAX_BATCH_WINDOW;
+		for (size_t i = 0; i < left; i++) {
+			pending[i] = keys[start + i];
+			where[i] = start + i;
+			results[start + i] = 0;
+		}
+		for (int s = sf->count - 1; s >= 0 && left > 0; s--) {
+			bloom_check_batch(&sf->stages[s], pending, left, hits);
+			size_t kept = 0;
+			for (size_t i = 0; i < left; i++) {
+				if (hits[i]) {
+					results[where[i]] = 1;
+				} else {
+					pending[kept] = pending[i];
+					where[kept] = where[i];
+					kept++;
+				}
+			}
+			left = kept;
+		}
+	}
+}
+
+void scalable_report(const ScalableFilter *sf) {
+	uint64_t items = 0;
+	size_t bytes = 0;
+	double miss = 1;  // chance a lookup for a missing key gets past every stage
+	for (int i = 0; i < sf->count; i++) {
+		const BloomFilter *stage = &sf->stages[i];
+		items += stage->items;
+		bytes += bloom_bytes(stage->size, stage->layout);
+		miss *= 1 - bloom_expected_fpr(stage, stage->layout, stage->items);
+	}
+	fprintf(stderr, "Scalable: %d stages, %llu items, %.1f MB, target FPR %.3g, expected FPR %.3g\n",
+		sf->count, (unsigned long long)items, bytes / 1048576.0, sf->fpr, 1 - miss);
+	for (int i = 0; i < sf->count; i++) {
+		fprintf(stderr, "  stage %d: ", i);
+		bloom_report(&sf->stages[i]);
+	}
+}
+
+// Cuckoo filter functions
+#define CUCKOO_MAX_KICKS 500
+#define CUCKOO_LOAD 0.95          // how full a 4-way table can reliably get
+
+// Everything a lookup needs once the key has been hashed
+typedef struct {
+	uint64_t bucket[2];
+	uint32_t fingerprint;
+} CuckooProbe;
+
+static inline void *cuckoo_bucket(const CuckooFilter *cf, uint64_t bucket) {
+	return (char *)cf->table + bucket * CUCKOO_SLOTS * (cf->fingerprint_bits / 8);
+}
+
+static inline uint32_t cuckoo_get(const CuckooFilter *cf, uint64_t bucket, int slot) {
+	if (cf->fingerprint_bits == 8) {
+		return ((const uint8_t *)cuckoo_bucket(cf, bucket))[slot];
+	}
+	return ((const uint16_t *)cuckoo_bucket(cf, bucket))[slot];
+}
+
+static inline void cuckoo_put(CuckooFilter *cf, uint64_t bucket, int slot, uint32_t fingerprint) {
+	if (cf->fingerprint_bits == 8) {
+		((uint8_t *)cuckoo_bucket(cf, bucket))[slot] = fingerprint;
+	} else {
+		((uint16_t *)cuckoo_bucket(cf, bucket))[slot] = fingerprint;
+	}
+}
+
+// Partial-key cuckoo hashing: the other bucket only depends on this one and the fingerprint
+static inline uint64_t cuckoo_alt(const CuckooFilter *cf, uint64_t bucket, uint32_t fingerprint) {
+	return (bucket ^ (fingerprint * 0x5bd1e995ULL)) & (cf->buckets - 1);
+}
+
+/*
+ * Whether any of the bucket's four slots holds fingerprint, all compared at
+ * once: XOR turns a match into a zero lane, and (x - 0x01..) & ~x & 0x80..
+ * is nonzero exactly when some lane of x is zero.
+ */
+static inline int cuckoo_bucket_has(const CuckooFilter *cf, uint64_t bucket, uint32_t fingerprint) {
+	if (cf->fingerprint_bits == 8) {
+		uint32_t x;
+		memcpy(&x, cuckoo_bucket(cf, bucket), sizeof(x));
+		x ^= fingerprint * 0x01010101U;
+		return ((x - 0x01010101U) & ~x & 0x80808080U) != 0;
+	}
+	uint64_t x;
+	memcpy(&x, cuckoo_bucket(cf, bucket), sizeof(x));
+	x ^= fingerprint * 0x0001000100010001ULL;
+	return ((x - 0x0001000100010001ULL) & ~x & 0x8000800080008000ULL) != 0;
+}
+
+// Smallest fingerprint that gets a 4-way table under fpr (about 8 / 2^bits), as a whole byte
+int cuckoo_fingerprint_bits(double fpr) {
+	return log2(2 * CUCKOO_SLOTS / fpr) <= 8 ? 8 : 16;
+}
+
+// Enough power-of-two buckets to hold items at CUCKOO_LOAD
+void cuckoo_init(CuckooFilter *cf, uint64_t items, int fingerprint_bits) {
+	uint64_t buckets = 1;
+	while (buckets * CUCKOO_SLOTS * CUCKOO_LOAD < items) {
+		buckets <<= 1;
+	}
+	cf->table = page_alloc(buckets * CUCKOO_SLOTS * (fingerprint_bits / 8), &cf->table_size, &cf->pages);
+	cf->buckets = buckets;
+	cf->fingerprint_bits = fingerprint_bits;
+	cf->engine = hash_engine;
+	cf->items = 0;
+	cf->failed = 0;
+	cf->rng = 0x2545F4914F6CDD1DULL;
+	cf->victim_used = 0;
+}
+
+void cuckoo_free(CuckooFilter *cf) {
+	page_free(cf->table, cf->table_size);
+}
+
+void cuckoo_hash(const CuckooFilter *cf, const char *str, size_t len, CuckooProbe *probe) {
+	uint64_t h[2];
+	cf->engine->fn(str, len, 0, h);
+	uint32_t fingerprint = h[1] >> (64 - cf->fingerprint_bits);
+	probe->fingerprint = fingerprint ? fingerprint : 1;  // 0 marks an empty slot
+	probe->bucket[0] = h[0] & (cf->buckets - 1);
+	probe->bucket[1] = cuckoo_alt(cf, probe->bucket[0], probe->fingerprint);
+}
+
+static int cuckoo_insert_into(CuckooFilter *cf, uint64_t bucket, uint32_t fingerprint) {
+	for (int slot = 0; slot < CUCKOO_SLOTS; slot++) {
+		if (cuckoo_get(cf, bucket, slot) == 0) {
+			cuckoo_put(cf, bucket, slot, fingerprint);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Puts fingerprint in bucket or its alternate, kicking a random entry over to
+ * its own alternate bucket when both are full. After CUCKOO_MAX_KICKS the
+ * entry still homeless is parked as the victim, which lookups also check.
+ */
+void cuckoo_place(CuckooFilter *cf, uint64_t bucket, uint32_t fingerprint) {
+	if (cuckoo_insert_into(cf, bucket, fingerprint)) {
+		return;
+	}
+	bucket = cuckoo_alt(cf, bucket, fingerprint);
+	if (cuckoo_insert_into(cf, bucket, fingerprint)) {
+		return;
+	}
+	for (int kick = 0; kick < CUCKOO_MAX_KICKS; kick++) {
+		cf->rng ^= cf->rng << 13;
+		cf->rng ^= cf->rng >> 7;
+		cf->rng ^= cf->rng << 17;
+		int slot = cf->rng % CUCKOO_SLOTS;
+		uint32_t evicted = cuckoo_get(cf, bucket, slot);
+		cuckoo_put(cf, bucket, slot, fingerprint);
+		fingerprint = evicted;
+		bucket = cuckoo_alt(cf, bucket, fingerprint);
+		if (cuckoo_insert_into(cf, bucket, fingerprint)) {
+			return;
+		}
+	}
+	cf->victim_used = 1;
+	cf->victim_bucket = bucket;
+	cf->victim_fingerprint = fingerprint;
+}
+
+int cuckoo_test(const CuckooFilter *cf, const CuckooProbe *probe) {
+	if (cuckoo_bucket_has(cf, probe->bucket[0], probe->fingerprint)
+			|| cuckoo_bucket_has(cf, probe->bucket[1], probe->fingerprint)) {
+		return 1;
+	}
+	return cf->victim_used && cf->victim_fingerprint == probe->fingerprint
+		&& (cf->victim_bucket == probe->bucket[0] || cf->victim_bucket == probe->bucket[1]);
+}
+
+/*
+ * Every call stores another copy of the fingerprint, so feed each distinct
+ * word in once (load_corpus() dedupes through the word set). Once there's a
+ * victim the table is full, and later keys are counted as failed.
+ */
+void cuckoo_add(CuckooFilter *cf, const char *str, size_t len) {
+	if (cf->victim_used) {
+		cf->failed++;
+		return;
+	}
+	CuckooProbe probe;
+	cuckoo_hash(cf, str, len, &probe);
+	cuckoo_place(cf, probe.bucket[0], probe.fingerprint);
+	cf->items++;
+}
+
+int cuckoo_check(const CuckooFilter *cf, const char *str, size_t len) {
+	CuckooProbe probe;
+	cuckoo_hash(cf, str, len, &probe);
+	return cuckoo_test(cf, &probe);
+}
+
+/*
+ * Takes one copy of a key's fingerprint back out. Returns 1 if it was there
+ * and 0 if not. Two added keys with the same fingerprint and buckets each
+ * have their own copy, so removing one leaves the other. Only remove keys
+ * that were really added: a key that wasn't would take another key's copy.
+ */
+int cuckoo_remove(CuckooFilter *cf, const char *str, size_t len) {
+	CuckooProbe probe;
+	cuckoo_hash(cf, str, len, &probe);
+	for (int i = 0; i < 2; i++) {
+		for (int slot = 0; slot < CUCKOO_SLOTS; slot++) {
+			if (cuckoo_get(cf, probe.bucket[i], slot) == probe.fingerprint) {
+				cuckoo_put(cf, probe.bucket[i], slot, 0);
+				cf->items--;
+				// There's room now, so the victim can go back into the table
+				if (cf->victim_used) {
+					cf->victim_used = 0;
+					cuckoo_place(cf, cf->victim_bucket, cf->victim_fingerprint);
+				}
+				return 1;
+			}
+		}
+	}
+	if (cf->victim_used && cf->victim_fingerprint == probe.fingerprint
+			&& (cf->victim_bucket == probe.bucket[0] || cf->victim_bucket == probe.bucket[1])) {
+		cf->victim_used = 0;
+		cf->items--;
+		return 1;
+	}
+	return 0;
+}
+
+// Same windows as bloom_check_batch(): hash and prefetch both buckets, then compare
+void cuckoo_check_batch(CuckooFilter *cf, const Key *keys, size_t n, int *results) {
+	CuckooProbe probes[MAX_BATCH_WINDOW];
+
+	for (size_t start = 0; start < n; start += batch_window) {
+		size_t count = n - start < (size_t)batch_window ? n - start : (size_t)batch_window;
+		for (size_t i = 0; i < count; i++) {
+			cuckoo_hash(cf, keys[start + i].str, keys[start + i].len, &probes[i]);
+			__builtin_prefetch(cuckoo_bucket(cf, probes[i].bucket[0]));
+			__builtin_prefetch(cuckoo_bucket(cf, probes[i].bucket[1]));
+		}
+		for (size_t i = 0; i < count; i++) {
+			results[start + i] = cuckoo_test(cf, &probes[i]);
+		}
+	}
+}
+
+// A lookup compares against up to 8 stored fingerprints, each a 1 in 2^bits - 1 match
+void cuckoo_report(const CuckooFilter *cf) {
+	uint64_t slots = cf->buckets * CUCKOO_SLOTS;
+	double bytes = (double)slots * (cf->fingerprint_bits / 8);
+	double fpr = 1 - pow(1 - 1.0 / ((1 << cf->fingerprint_bits) - 1), 2.0 * CUCKOO_SLOTS * cf->items / slots);
+	fprintf(stderr, "Cuckoo: %llu buckets x %d, %d-bit fingerprints, %llu items (%.1f%% full), "
+		"%.1f MB, %.1f bits per item, expected FPR %.3g",
+		(unsigned long long)cf->buckets, CUCKOO_SLOTS, cf->fingerprint_bits, (unsigned long long)cf->items,
+		100.0 * cf->items / slots, bytes / 1048576.0, cf->items ? bytes * 8 / cf->items : 0.0, fpr);
+	if (cf->failed > 0) {
+		fprintf(stderr, ", %llu inserts didn't fit", (unsigned long long)cf->failed);
+	}
+	page_report(cf->pages);
+	fprintf(stderr, "\n");
+}
+
+// Binary fuse filter functions
+#define FUSE_MAX_ATTEMPTS 100
+#define FUSE_MAX_SEGMENT_LENGTH (1 << 18)
+
+void fuse_init(FuseFilter *ff, int fingerprint_bits) {
+	memset(ff, 0, sizeof(*ff));
+	ff->fingerprint_bits = fingerprint_bits;
+	ff->engine = hash_engine;
+}
+
+void fuse_free(FuseFilter *ff) {
+	page_free(ff->fingerprints, ff->fingerprints_size);
+	free(ff->keys);
+}
+
+void fuse_add(FuseFilter *ff, const char *str, size_t len) {
+	if (ff->key_count == ff->key_capacity) {
+		ff->key_capacity = ff->key_capacity ? ff->key_capacity * 2 : 1 << 16;
+		ff->keys = realloc(ff->keys, ff->key_capacity * sizeof(*ff->keys));
+		if (ff->keys == NULL) {
+			fprintf(stderr, "Failed to allocate memory for fuse filter keys\n");
+			exit(1);
+		}
+	}
+	uint64_t h[2];
+	ff->engine->fn(str, len, 0, h);
+	ff->keys[ff->key_count++] = h[0];
+}
+
+static inline uint64_t fuse_mix(const FuseFilter *ff, uint64_t key) {
+	return fmix64(key + ff->seed);
+}
+
+static inline uint32_t fuse_fingerprint(const FuseFilter *ff, uint64_t hash) {
+	return (uint32_t)(hash ^ (hash >> 32)) & ((1U << ff->fingerprint_bits) - 1);
+}
+
+/*
+ * Slot i of a key: the top bits of the hash pick the first segment, slot i
+ * lands in segment + i, and its offset inside the segment is the first
+ * segment's offset XORed with 18 more hash bits (none for slot 0).
+ */
+static inline uint32_t fuse_slot(const FuseFilter *ff, uint64_t hash, int i) {
+	uint64_t h = fastrange64(hash, ff->segment_count_length) + (uint64_t)i * ff->segment_length;
+	uint64_t bits = hash & ((1ULL << 36) - 1);
+	return (uint32_t)(h ^ ((bits >> (36 - 18 * i)) & (ff->segment_length - 1)));
+}
+
+static inline uint32_t fuse_get(const FuseFilter *ff, uint32_t slot) {
+	if (ff->fingerprint_bits == 8) {
+		return ((const uint8_t *)ff->fingerprints)[slot];
+	}
+	return ((const uint16_t *)ff->fingerprints)[slot];
+}
+
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Segment length and array size for n keys, from the paper's fits for three
+ * hashes. Too small a segment and the build keeps failing, too big and the
+ * three slots stop being cache-friendly neighbours.
+ */
+void fuse_size(FuseFilter *ff, uint32_t n) {
+	uint32_t segment_length = n > 1 ? 1U << (int)floor(log((double)n) / log(3.33) + 2.25) : 4;
+	if (segment_length > FUSE_MAX_SEGMENT_LENGTH) segment_length = FUSE_MAX_SEGMENT_LENGTH;
+	double size_factor = n > 1 ? fmax(1.125, 0.875 + 0.25 * log(1000000.0) / log((double)n)) : 0;
+	uint32_t capacity = (uint32_t)round(n * size_factor);
+	int64_t segment_count = ((int64_t)capacity + segment_length - 1) / segment_length - 2;
+	if (segment_count < 1) segment_count = 1;
+	ff->segment_length = segment_length;
+	ff->segment_count_length = segment_count * segment_length;
+	ff->array_length = (segment_count + 2) * segment_length;
+}
+
+/*
+ * Builds the array from the collected keys (duplicates dropped first). Keys
+ * get peeled off slots that only one key still maps to, then assigned in
+ * reverse so each key's last free slot makes its three XOR to the
+ * fingerprint. A peel that gets stuck means a bad seed, so try another.
+ */
+void fuse_build(FuseFilter *ff) {
+	qsort(ff->keys, ff->key_count, sizeof(*ff->keys), compare_u64);
+	size_t unique = 0;
+	for (size_t i = 0; i < ff->key_count; i++) {
+		if (unique == 0 || ff->keys[i] != ff->keys[unique - 1]) {
+			ff->keys[unique++] = ff->keys[i];
+		}
+	}
+	if (unique > UINT32_MAX / 2) {
+		fprintf(stderr, "Too many keys for a fuse filter\n");
+		exit(1);
+	}
+	uint32_t n = unique;
+	ff->duplicates = ff->key_count - unique;
+	fuse_size(ff, n);
+
+	uint32_t length = ff->array_length;
+	ff->fingerprints = page_alloc((size_t)length * (ff->fingerprint_bits / 8), &ff->fingerprints_size, &ff->pages);
+	uint64_t *order = malloc((n + 1) * sizeof(*order));   // peeled keys, in peel order
+	uint8_t *order_slot = malloc(n + 1);                   // which of the three slots each one got
+	uint8_t *counts = malloc(length);                      // keys per slot << 2 | XOR of their slot numbers
+	uint64_t *xors = malloc((size_t)length * sizeof(*xors));   // XOR of the hashes of those keys
+	uint32_t *alone = malloc((size_t)length * sizeof(*alone));
+	if (order == NULL || order_slot == NULL || counts == NULL
+			|| xors == NULL || alone == NULL) {
+		fprintf(stderr, "Failed to allocate memory for fuse filter\n");
+		exit(1);
+	}
+
+	uint64_t rng = 0x726b2b9d438b9d4dULL;
+	uint32_t peeled = 0;
+	for (ff->attempts = 1; ; ff->attempts++) {
+		if (ff->attempts > FUSE_MAX_ATTEMPTS) {
+			fprintf(stderr, "Failed to build fuse filter after %d seeds\n", FUSE_MAX_ATTEMPTS);
+			exit(1);
+		}
+		rng += 0x9E3779B97F4A7C15ULL;
+		ff->seed = mix64(rng);
+		memset(counts, 0, length);
+		memset(xors, 0, (size_t)length * sizeof(*xors));
+
+		int overflow = 0;
+		for (uint32_t k = 0; k < n; k++) {
+			uint64_t hash = fuse_mix(ff, ff->keys[k]);
+			for (int i = 0; i < 3; i++) {
+				uint32_t slot = fuse_slot(ff, hash, i);
+				counts[slot] += 4;
+				counts[slot] ^= i;
+				xors[slot] ^= hash;
+				overflow |= counts[slot] < 4;  // more than 63 keys wrapped the count
+			}
+		}
+		if (overflow) {
+			continue;
+		}
+
+		uint32_t queued = 0;
+		for (uint32_t slot = 0; slot < length; slot++) {
+			alone[queued] = slot;
+			queued += (counts[slot] >> 2) == 1;
+		}
+		peeled = 0;
+		while (queued > 0) {
+			uint32_t slot = alone[--queued];
+			if ((counts[slot] >> 2) != 1) {
+				continue;
+			}
+			uint64_t hash = xors[slot];
+			int found = counts[slot] & 3;
+			order[peeled] = hash;
+			order_slot[peeled] = found;
+			peeled++;
+			for (int i = 0; i < 3; i++) {
+				if (i == found) {
+					continue;
+				}
+				uint32_t other = fuse_slot(ff, hash, i);
+				alone[queued] = other;
+				queued += (counts[other] >> 2) == 2;
+				counts[other] -= 4;
+				counts[other] ^= i;
+				xors[other] ^= hash;
+			}
+		}
+		if (peeled == n) {
+			break;
+		}
+	}
+
+	for (uint32_t k = peeled; k-- > 0; ) {
+		uint64_t hash = order[k];
+		uint32_t slots[3] = {fuse_slot(ff, hash, 0), fuse_slot(ff, hash, 1), fuse_slot(ff, hash, 2)};
+		int found = order_slot[k];
+		uint32_t value = fuse_fingerprint(ff, hash)
+			^ fuse_get(ff, slots[(found + 1) % 3]) ^ fuse_get(ff, slots[(found + 2) % 3]);
+		if (ff->fingerprint_bits == 8) {
+			((uint8_t *)ff->fingerprints)[slots[found]] = value;
+		} else {
+			((uint16_t *)ff->fingerprints)[slots[found]] = value;
+		}
+	}
+	ff->items = n;
+
+	free(order);
+	free(order_slot);
+	free(counts);
+	free(xors);
+	free(alone);
+	free(ff->keys);
+	ff->keys = NULL;
+	ff->key_count = ff->key_capacity = 0;
+}
+
+// Three loads per key; prefetched a window at a time like the other filters
+void fuse_check_batch(FuseFilter *ff, const Key *keys, size_t n, int *results) {
+	uint64_t hashes[MAX_BATCH_WINDOW];
+	uint32_t slots[MAX_BATCH_WINDOW][3];
+
+	for (size_t start = 0; start < n; start += batch_window) {
+		size_t count = n - start < (size_t)batch_window ? n - start : (size_t)batch_window;
+		for (size_t i = 0; i < count; i++) {
+			uint64_t h[2];
+			ff->engine->fn(keys[start + i].str, keys[start + i].len, 0, h);
+			hashes[i] = fuse_mix(ff, h[0]);
+			for (int j = 0; j < 3; j++) {
+				slots[i][j] = fuse_slot(ff, hashes[i], j);
+				__builtin_prefetch((char *)ff->fingerprints + (size_t)slots[i][j] * (ff->fingerprint_bits / 8));
+			}
+		}
+		for (size_t i = 0; i < count; i++) {
+			uint32_t value = fuse_get(ff, slots[i][0]) ^ fuse_get(ff, slots[i][1]) ^ fuse_get(ff, slots[i][2]);
+			results[start + i] = value == fuse_fingerprint(ff, hashes[i]);
+		}
+	}
+}
+
+void fuse_report(const FuseFilter *ff) {
+	double bytes = (double)ff->array_length * (ff->fingerprint_bits / 8);
+	fprintf(stderr, "Fuse: %llu keys (%llu duplicates dropped), %d-bit fingerprints, %u slots in segments of %u, "
+		"%.1f MB, %.1f bits per key, expected FPR %.3g, built on try %d",
+		(unsigned long long)ff->items, (unsigned long long)ff->duplicates, ff->fingerprint_bits,
+		ff->array_length, ff->segment_length, bytes / 1048576.0, ff->items ? bytes * 8 / ff->items : 0.0,
+		1.0 / (1 << ff->fingerprint_bits), ff->attempts);
+	page_report(ff->pages);
+	fprintf(stderr, "\n");
+}
+
+// Filter functions: dispatch on the kind of filter
+void filter_add(Filter *filter, const char *str, size_t len) {
+	switch (filter->kind) {
+	case FILTER_BLOOM:
+		bloom_add(&filter->bloom, str, len);
+		break;
+	case FILTER_SCALABLE:
+		scalable_add(&filter->scalable, str, len);
+		break;
+	case FILTER_CUCKOO:
+		cuckoo_add(&filter->cuckoo, str, len);
+		break;
+	case FILTER_FUSE:
+		fuse_add(&filter->fuse, str, len);
+		break;
+	}
+}
+
+// Only cuckoo filters and counting Bloom filters can take a word back out; 1 if it was there
+int filter_remove(Filter *filter, const char *str, size_t len) {
+	switch (filter->kind) {
+	case FILTER_BLOOM:
+		return bloom_remove(&filter->bloom, str, len) > 0;
+	case FILTER_CUCKOO:
+		return cuckoo_remove(&filter->cuckoo, str, len);
+	default:
+		return 0;
+	}
+}
+
+void filter_check_batch(Filter *filter, const Key *keys, size_t n, int *results) {
+	switch (filter->kind) {
+	case FILTER_BLOOM:
+		bloom_check_batch(&filter->bloom, keys, n, results);
+		break;
+	case FILTER_SCALABLE:
+		scalable_check_batch(&filter->scalable, keys, n, results);
+		break;
+	case FILTER_CUCKOO:
+		cuckoo_check_batch(&filter->cuckoo, keys, n, results);
+		break;
+	case FILTER_FUSE:
+		fuse_check_batch(&filter->fuse, keys, n, results);
+		break;
+	}
+}
+
+// Called once every key is in, for the kinds that build in one go
+void filter_finish(Filter *filter) {
+	if (filter->kind == FILTER_FUSE) {
+		fuse_build(&filter->fuse);
+	}
+}
+
+void filter_report(const Filter *filter) {
+	switch (filter->kind) {
+	case FILTER_BLOOM:
+		bloom_report(&filter->bloom);
+		break;
+	case FILTER_SCALABLE:
+		scalable_report(&filter->scalable);
+		break;
+	case FILTER_CUCKOO:
+		cuckoo_report(&filter->cuckoo);
+		break;
+	case FILTER_FUSE:
+		fuse_report(&filter->fuse);
+		break;
+	}
+}
+
+void filter_free(Filter *filter) {
+	switch (filter->kind) {
+	case FILTER_BLOOM:
+		bloom_free(&filter->bloom);
+		break;
+	case FILTER_SCALABLE:
+		scalable_free(&filter->scalable);
+		break;
+	case FILTER_CUCKOO:
+		cuckoo_free(&filter->cuckoo);
+		break;
+	case FILTER_FUSE:
+		fuse_free(&filter->fuse);
+		break;
+	}
+}
+
+// Arena functions
+// Copies str into the arena as a length-prefixed record and returns the record
+const char *arena_store(Arena *arena, const char *str, size_t len) {
+	size_t need = (sizeof(uint32_t) + len + 3) & ~(size_t)3;  // keeps prefixes aligned
+	ArenaSlab *slab = arena->head;
+	if (slab == NULL || slab->used + need > slab->size) {
+		size_t size = need > ARENA_SLAB_SIZE ? need : ARENA_SLAB_SIZE;
+		slab = malloc(sizeof(ArenaSlab) + size);
+		if (slab == NULL) {
+			fprintf(stderr, "Failed to allocate memory for word arena\n");
+			exit(1);
+		}
+		slab->next = arena->head;
+		slab->used = 0;
+		slab->size = size;
+		arena->head = slab;
+		arena->slabs++;
+	}
+
+	char *record = slab->data + slab->used;
+	uint32_t len32 = (uint32_t)len;
+	memcpy(record, &len32, sizeof(len32));
+	memcpy(record + sizeof(len32), str, len);
+	slab->used += need;
+	arena->bytes += need;
+	arena->strings++;
+	return record;
+}
+
+static inline uint32_t record_len(const char *record) {
+	uint32_t len;
+	memcpy(&len, record, sizeof(len));
+	return len;
+}
+
+void arena_free(Arena *arena) {
+	while (arena->head != NULL) {
+		ArenaSlab *next = arena->head->next;
+		free(arena->head);
+		arena->head = next;
+	}
+	arena->slabs = arena->bytes = arena->strings = 0;
+}
+
+// Hash table functions
+uint64_t hash_string(const char *str, size_t len) {
+	uint64_t out[2];
+	hash_engine->fn(str, len, 0, out);
+	return out[0];
+}
+
+static inline uint8_t word_tag(uint64_t hash) {
+	return (hash >> 51) & 0x7f;
+}
+
+static inline WordSet *word_shard(uint64_t hash) {
+	return &word_sets[hash >> 58];
+}
+
+// Bitmask of the slots in the group at ctrl whose control byte is tag
+static inline unsigned group_match(const uint8_t *ctrl, uint8_t tag) {
+#ifdef HAVE_X86_SIMD
+	__m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+#else
+	unsigned mask = 0;
+	for (int i = 0; i < WORD_GROUP; i++) {
+		mask |= (unsigned)(ctrl[i] == tag) << i;
+	}
+	return mask;
+#endif
+}
+
+/*
+ * Groups are probed triangularly (g, g+1, g+3, g+6, ...), which visits every
+ * group of a power-of-two table. Returns the slot holding the word, or the
+ * empty slot where it would go.
+ */
+size_t word_find(const WordSet *set, const char *word, size_t len, uint64_t hash, int *found) {
+	size_t groups = set->capacity / WORD_GROUP;
+	size_t g = hash & (groups - 1);
+	uint8_t tag = word_tag(hash);
+
+	for (size_t step = 1; ; step++) {
+		const uint8_t *ctrl = set->ctrl + g * WORD_GROUP;
+		for (unsigned match = group_match(ctrl, tag); match; match &= match - 1) {
+			size_t i = g * WORD_GROUP + __builtin_ctz(match);
+			const char *record = set->slots[i].word;
+			if (record_len(record) == len && memcmp(record + sizeof(uint32_t), word, len) == 0) {
+				*found = 1;
+				return i;
+			}
+		}
+		unsigned empty = group_match(ctrl, WORD_EMPTY);
+		if (empty) {
+			*found = 0;
+			return g * WORD_GROUP + __builtin_ctz(empty);
+		}
+		g = (g + step) & (groups - 1);
+	}
+}
+
+// First empty slot on the probe path, for reinserting during a resize
+size_t word_empty_slot(const WordSet *set, uint64_t hash) {
+	size_t groups = set->capacity / WORD_GROUP;
+	size_t g = hash & (groups - 1);
+
+	for (size_t step = 1; ; step++) {
+		unsigned empty = group_match(set->ctrl + g * WORD_GROUP, WORD_EMPTY);
+		if (empty) {
+			return g * WORD_GROUP + __builtin_ctz(empty);
+		}
+		g = (g + step) & (groups - 1);
+	}
+}
+
+// Table allocations so far, for the memory report (the arena counts its own)
+size_t word_table_allocs = 0;
+
+void word_set_alloc(WordSet *set, size_t capacity) {
+	set->capacity = capacity;
+	set->count = 0;
+	set->deleted = 0;
+	__atomic_add_fetch(&word_table_allocs, 2, __ATOMIC_RELAXED);
+	set->ctrl = malloc(capacity);
+	set->slots = malloc(capacity * sizeof(WordSlot));
+	if (set->ctrl == NULL || set->slots == NULL) {
+		fprintf(stderr, "Failed to allocate memory for word set\n");
+		exit(1);
+	}
+	memset(set->ctrl, WORD_EMPTY, capacity);
+}
+
+// Doubles the table once it's 7/8 full (counting deleted slots); deleted slots are dropped
+void word_set_grow(WordSet *set) {
+	WordSet old = *set;
+	word_set_alloc(set, old.capacity * 2);
+	for (size_t i = 0; i < old.capacity; i++) {
+		if (old.ctrl[i] == WORD_EMPTY || old.ctrl[i] == WORD_DELETED) {
+			continue;
+		}
+		size_t slot = word_empty_slot(set, old.slots[i].hash);
+		set->ctrl[slot] = old.ctrl[i];
+		set->slots[slot] = old.slots[i];
+		set->count++;
+	}
+	free(old.ctrl);
+	free(old.slots);
+}
+
+void init_word_set(void) {
+	for (int i = 0; i < WORD_SHARDS; i++) {
+		word_set_alloc(&word_sets[i], 1024);
+		word_sets[i].arena = (Arena){NULL, 0, 0, 0};
+		pthread_mutex_init(&word_sets[i].lock, NULL);
+	}
+}
+
+/*
+ * Safe to call from several build threads; duplicates are only stored once.
+ * Returns 1 if the word is new and 0 if it was already there.
+ */
+int add_word(const char *word, size_t len) {
+	uint64_t hash = hash_string(word, len);
+	WordSet *set = word_shard(hash);
+
+	pthread_mutex_lock(&set->lock);
+	int found;
+	size_t slot = word_find(set, word, len, hash, &found);
+	if (!found) {
+		if ((set->count + set->deleted + 1) * 8 > set->capacity * 7) {
+			word_set_grow(set);
+			slot = word_empty_slot(set, hash);
+		}
+		set->ctrl[slot] = word_tag(hash);
+		set->slots[slot] = (WordSlot){arena_store(&set->arena, word, len), hash};
+		set->count++;
+	}
+	pthread_mutex_unlock(&set->lock);
+	return !found;
+}
+
+// Returns 1 if the word was there; its string stays in the arena until free_word_set()
+int remove_word(const char *word, size_t len) {
+	uint64_t hash = hash_string(word, len);
+	WordSet *set = word_shard(hash);
+
+	pthread_mutex_lock(&set->lock);
+	int found;
+	size_t slot = word_find(set, word, len, hash, &found);
+	if (found) {
+		set->ctrl[slot] = WORD_DELETED;
+		set->count--;
+		set->deleted++;
+	}
+	pthread_mutex_unlock(&set->lock);
+	return found;
+}
+
+int check_word(const char *word, size_t len) {
+	uint64_t hash = hash_string(word, len);
+	int found;
+	word_find(word_shard(hash), word, len, hash, &found);
+	return found;
+}
+
+// Peak RSS, and how much of it the exact-match set accounts for
+void word_set_report(void) {
+	size_t words = 0, slabs = 0, bytes = 0, table_bytes = 0;
+	for (int i = 0; i < WORD_SHARDS; i++) {
+		words += word_sets[i].count;
+		slabs += word_sets[i].arena.slabs;
+		bytes += word_sets[i].arena.bytes;
+		table_bytes += word_sets[i].capacity * (1 + sizeof(WordSlot));
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	fprintf(stderr, "Word set: %zu words, %.1f MB strings in %zu slabs, %.1f MB table, "
+		"%zu allocations, peak RSS %.1f MB\n",
+		words, bytes / 1048576.0, slabs, table_bytes / 1048576.0,
+		slabs + word_table_allocs, usage.ru_maxrss / 1024.0);
+}
+
+// One free per slab and two per shard, no matter how many words there are
+void free_word_set(void) {
+	for (int i = 0; i < WORD_SHARDS; i++) {
+		WordSet *set = &word_sets[i];
+		arena_free(&set->arena);
+		free(set->ctrl);
+		free(set->slots);
+		pthread_mutex_destroy(&set->lock);
+	}
+}
+
+// Input files
+/*
+ * The whole file is mmapped and handed out one line at a time as a Key
+ * pointing straight into the mapping: no copies, no line length limit.
+ * memchr finds the newlines (glibc's is AVX2/EVEX vectorized), and a '\r'
+ * right before the '\n' is dropped so CRLF files work too.
+ */
+typedef struct {
+	const char *data;
+	size_t size;
+	size_t pos;
+} LineScanner;
+
+int scanner_open(LineScanner *scanner, const char *path) {
+	scanner->data = NULL;
+	scanner->size = scanner->pos = 0;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size > 0) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+		scanner->data = map;
+		scanner->size = st.st_size;
+	}
+	close(fd);
+	return 0;
+}
+
+void scanner_close(LineScanner *scanner) {
+	if (scanner->data != NULL) {
+		munmap((void *)scanner->data, scanner->size);
+	}
+}
+
+int scanner_next(LineScanner *scanner, Key *line) {
+	if (scanner->pos >= scanner->size) {
+		return 0;
+	}
+	const char *start = scanner->data + scanner->pos;
+	size_t left = scanner->size - scanner->pos;
+	const char *newline = memchr(start, '\n', left);
+	size_t len = newline ? (size_t)(newline - start) : left;
+
+	scanner->pos += newline ? len + 1 : len;
+	if (len > 0 && start[len - 1] == '\r') {  // also on a last line with no newline after it
+		len--;
+	}
+	line->str = start;
+	line->len = len;
+	return 1;
+}
+
+// Thread t's share of the file as its own scanner, cut on line boundaries
+LineScanner scanner_slice(const LineScanner *scanner, int t, int threads) {
+	size_t start = scanner->size * t / threads;
+	size_t stop = scanner->size * (t + 1) / threads;
+	while (start > 0 && start < scanner->size && scanner->data[start - 1] != '\n') start++;
+	while (stop > 0 && stop < scanner->size && scanner->data[stop - 1] != '\n') stop++;
+	if (stop < start) stop = start;
+	return (LineScanner){scanner->data + start, stop - start, 0};
+}
+
+// Number of lines, for sizing a filter before anything is added to it
+uint64_t scanner_count(const LineScanner *scanner) {
+	uint64_t lines = 0;
+	const char *p = scanner->data, *end = scanner->data + scanner->size;
+	while (p < end) {
+		const char *newline = memchr(p, '\n', end - p);
+		lines++;
+		if (newline == NULL) {
+			break;
+		}
+		p = newline + 1;
+	}
+	return lines;
+}
+
+// NUMA
+#define MAX_NUMA_NODES 64
+
+NumaMode numa_mode = NUMA_OFF;  // --numa
+int numa_nodes = 0;             // 0 until numa_discover() has run
+int numa_node_ids[MAX_NUMA_NODES];
+cpu_set_t numa_cpus[MAX_NUMA_NODES];
+
+// Parses a sysfs list like "0-3,8-11", calling add() on every number in it
+static void parse_cpulist(const char *text, void (*add)(int n, void *arg), void *arg) {
+	while (*text >= '0' && *text <= '9') {
+		char *end;
+		int first = strtol(text, &end, 10), last = first;
+		if (*end == '-') {
+			last = strtol(end + 1, &end, 10);
+		}
+		for (int n = first; n <= last; n++) {
+			add(n, arg);
+		}
+		text = *end == ',' ? end + 1 : end;
+	}
+}
+
+static void add_node(int node, void *arg) {
+	(void)arg;
+	if (numa_nodes < MAX_NUMA_NODES) {
+		numa_node_ids[numa_nodes++] = node;
+	}
+}
+
+static void add_cpu(int cpu, void *arg) {
+	CPU_SET(cpu, (cpu_set_t *)arg);
+}
+
+// Reads the online nodes and their CPUs from sysfs; no sysfs means one node
+void numa_discover(void) {
+	char line[4096];
+	numa_nodes = 0;
+	FILE *file = fopen("/sys/devices/system/node/online", "r");
+	if (file != NULL) {
+		if (fgets(line, sizeof(line), file) != NULL) {
+			parse_cpulist(line, add_node, NULL);
+		}
+		fclose(file);
+	}
+	if (numa_nodes == 0) {
+		numa_node_ids[numa_nodes++] = 0;
+	}
+	for (int i = 0; i < numa_nodes; i++) {
+		char path[64];
+		CPU_ZERO(&numa_cpus[i]);
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", numa_node_ids[i]);
+		file = fopen(path, "r");
+		if (file != NULL) {
+			if (fgets(line, sizeof(line), file) != NULL) {
+				parse_cpulist(line, add_cpu, &numa_cpus[i]);
+			}
+			fclose(file);
+		}
+	}
+}
+
+/*
+ * Sets the memory policy of [start, start + bytes) and moves pages that are
+ * already faulted in. Raw syscall, so there's no libnuma to link. Returns 0
+ * on success; failing just leaves the pages where they were.
+ */
+int numa_bind(void *start, size_t bytes, int mode, const int *nodes, int count) {
+	unsigned long mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long)) + 1] = {0};
+	for (int i = 0; i < count; i++) {
+		mask[nodes[i] / (8 * sizeof(unsigned long))] |= 1UL << (nodes[i] % (8 * sizeof(unsigned long)));
+	}
+	bytes = (bytes + 4095) & ~(size_t)4095;
+	return syscall(SYS_mbind, start, bytes, mode, mask, (unsigned long)MAX_NUMA_NODES + 1, MPOL_MF_MOVE);
+}
+
+// The arrays a filter reads on lookups, so they can be copied or moved between nodes
+typedef struct {
+	unsigned char **array;
+	void **mapping;    // BloomFilter keeps the mapping separately, NULL for the rest
+	size_t bytes;
+	size_t *mapped;
+	PagePolicy *pages;
+} FilterArray;
+
+int filter_arrays(Filter *filter, FilterArray *arrays) {
+	switch (filter->kind) {
+	case FILTER_BLOOM:
+		arrays[0] = (FilterArray){&filter->bloom.array, &filter->bloom.mapping,
+			bloom_bytes(filter->bloom.size, filter->bloom.layout), &filter->bloom.mapping_size, &filter->bloom.pages};
+		return 1;
+	case FILTER_SCALABLE:
+		for (int i = 0; i < filter->scalable.count; i++) {
+			BloomFilter *stage = &filter->scalable.stages[i];
+			arrays[i] = (FilterArray){&stage->array, &stage->mapping, bloom_bytes(stage->size, stage->layout),
+				&stage->mapping_size, &stage->pages};
+		}
+		return filter->scalable.count;
+	case FILTER_CUCKOO:
+		arrays[0] = (FilterArray){(unsigned char **)&filter->cuckoo.table, NULL,
+			filter->cuckoo.buckets * CUCKOO_SLOTS * (filter->cuckoo.fingerprint_bits / 8),
+			&filter->cuckoo.table_size, &filter->cuckoo.pages};
+		return 1;
+	case FILTER_FUSE:
+		arrays[0] = (FilterArray){(unsigned char **)&filter->fuse.fingerprints, NULL,
+			(size_t)filter->fuse.array_length * (filter->fuse.fingerprint_bits / 8),
+			&filter->fuse.fingerprints_size, &filter->fuse.pages};
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Makes replica a copy of filter whose arrays live on node. The copy owns its
+ * arrays (filter_free() it when done) and is only good for lookups: a fuse
+ * filter's collected keys aren't copied, and nothing else should add to it.
+ */
+void filter_replicate(Filter *replica, const Filter *filter, int node) {
+	FilterArray arrays[MAX_STAGES];
+	*replica = *filter;
+	int count = filter_arrays(replica, arrays);
+	for (int i = 0; i < count; i++) {
+		const unsigned char *source = *arrays[i].array;
+		unsigned char *copy = page_alloc(arrays[i].bytes, arrays[i].mapped, arrays[i].pages);
+		numa_bind(copy, *arrays[i].mapped, MPOL_BIND, &node, 1);
+		memcpy(copy, source, arrays[i].bytes);
+		*arrays[i].array = copy;
+		if (arrays[i].mapping != NULL) {
+			*arrays[i].mapping = copy;
+		}
+	}
+	if (replica->kind == FILTER_FUSE) {
+		replica->fuse.keys = NULL;
+		replica->fuse.key_count = replica->fuse.key_capacity = 0;
+	}
+}
+
+// Spreads the filter's arrays over every node, one page at a time
+void filter_interleave(Filter *filter) {
+	FilterArray arrays[MAX_STAGES];
+	int count = filter_arrays(filter, arrays);
+	int failed = 0;
+	for (int i = 0; i < count; i++) {
+		failed |= numa_bind(*arrays[i].array, arrays[i].bytes, MPOL_INTERLEAVE, numa_node_ids, numa_nodes) != 0;
+	}
+	fprintf(stderr, "NUMA: %s over %d nodes\n", failed ? "couldn't interleave the filter" : "filter interleaved",
+		numa_nodes);
+}
+
+// Parallel build
+typedef struct {
+	BloomFilter *filter;
+	LineScanner input;
+	int exact;  // also fill the exact-match table
+	uint64_t items;
+} BuildJob;
+
+void *build_worker(void *arg) {
+	BuildJob *job = arg;
+	BloomProbe probe;
+	Key key;
+	while (scanner_next(&job->input, &key)) {
+		bloom_hash(job->filter, key.str, key.len, &probe);
+		bloom_set_atomic(job->filter, &probe);
+		if (job->exact) {
+			add_word(key.str, key.len);
+		}
+		job->items++;
+	}
+	return NULL;
+}
+
+/*
+ * Splits the keys into one contiguous range per thread. Setting bits is an
+ * atomic OR, and OR doesn't care about order, so the result is bit for bit
+ * the same as adding the keys one at a time.
+ */
+void bloom_build_parallel(BloomFilter *filter, const LineScanner *input, int threads, int exact) {
+	pthread_t tids[threads];
+	BuildJob jobs[threads];
+
+	for (int t = 0; t < threads; t++) {
+		jobs[t] = (BuildJob){filter, scanner_slice(input, t, threads), exact, 0};
+		if (pthread_create(&tids[t], NULL, build_worker, &jobs[t]) != 0) {
+			fprintf(stderr, "Failed to start build thread\n");
+			exit(1);
+		}
+	}
+	for (int t = 0; t < threads; t++) {
+		pthread_join(tids[t], NULL);
+		filter->items += jobs[t].items;
+	}
+}
+
+// Counts one answer against the exact-match table
+void record_result(Results *results, int bloom_result, int actual_present) {
+	if (bloom_result) {
+		if (actual_present) results->true_positive++;
+		else results->false_positive++;
+		return;
+	}
+	if (actual_present) results->false_negative++;
+	else results->true_negative++;
+}
+
+// Query output
+/*
+ * Answers go through a ResultWriter instead of stdio, in whichever --output
+ * format was asked for. A writer with an fd fills a 1 MB buffer and write()s
+ * it out whole; one with fd -1 (a query thread's) keeps everything in memory
+ * until writer_merge() hands it to the real one.
+ */
+#define OUTPUT_BUFFER (1 << 20)
+
+OutputMode output_mode = OUTPUT_TEXT;  // --output
+
+typedef struct {
+	int fd;
+	char *buf;
+	size_t len;
+	size_t cap;
+	uint64_t line;      // line number of the next answer, from 1
+	uint64_t lines;
+	uint64_t maybes;
+	unsigned bits;      // bitset: bits that don't make a whole byte yet
+	int bit_count;
+} ResultWriter;
+
+// Grows *buffer so it can take need more bytes after len
+static void reserve(char **buffer, size_t *cap, size_t len, size_t need) {
+	if (len + need <= *cap) {
+		return;
+	}
+	size_t updated = *cap ? *cap : 4096;
+	while (updated < len + need) {
+		updated *= 2;
+	}
+	*buffer = realloc(*buffer, updated);
+	if (*buffer == NULL) {
+		fprintf(stderr, "Failed to allocate memory for a buffer\n");
+		exit(1);
+	}
+	*cap = updated;
+}
+
+void writer_init(ResultWriter *writer, int fd, uint64_t first_line) {
+	*writer = (ResultWriter){fd, NULL, 0, 0, first_line, 0, 0, 0, 0};
+	if (fd >= 0) {
+		reserve(&writer->buf, &writer->cap, 0, OUTPUT_BUFFER);
+	}
+}
+
+static void write_all(int fd, const char *data, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			fprintf(stderr, "Failed to write results: %s\n", strerror(errno));
+			exit(1);
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+void writer_flush(ResultWriter *writer) {
+	if (writer->fd >= 0) {
+		write_all(writer->fd, writer->buf, writer->len);
+		writer->len = 0;
+	}
+}
+
+// Room for need more bytes; a writer with an fd flushes before it grows
+static char *writer_space(ResultWriter *writer, size_t need) {
+	if (writer->len + need > writer->cap && writer->fd >= 0) {
+		writer_flush(writer);
+	}
+	reserve(&writer->buf, &writer->cap, writer->len, need);
+	return writer->buf + writer->len;
+}
+
+// Adds the lowest count (at most 8) bits of value to the bitset
+static void writer_bits(ResultWriter *writer, unsigned value, int count) {
+	unsigned bits = writer->bits | value << writer->bit_count;
+	writer->bit_count += count;
+	if (writer->bit_count >= 8) {
+		*writer_space(writer, 1) = bits;
+		writer->len++;
+		bits >>= 8;
+		writer->bit_count -= 8;
+	}
+	writer->bits = bits;
+}
+
+// Decimal digits of n at out, returns how many; no stdio on the hot path
+static int format_u64(char *out, uint64_t n) {
+	char digits[20];
+	int len = 0;
+	do {
+		digits[len++] = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	for (int i = 0; i < len; i++) {
+		out[i] = digits[len - 1 - i];
+	}
+	return len;
+}
+
+void writer_answer(ResultWriter *writer, const Key *key, int answer) {
+	uint64_t line = writer->line++;
+	writer->lines++;
+	writer->maybes += answer;
+	switch (output_mode) {
+	case OUTPUT_TEXT:
+		if (answer) {
+			memcpy(writer_space(writer, 6), "maybe\n", 6);
+			writer->len += 6;
+		} else {
+			memcpy(writer_space(writer, 3), "no\n", 3);
+			writer->len += 3;
+		}
+		break;
+	case OUTPUT_BITSET:
+		writer_bits(writer, answer, 1);
+		break;
+	case OUTPUT_POSITIVES:
+		if (answer) {
+			char *out = writer_space(writer, 20 + key->len + 2);
+			int len = format_u64(out, line);
+			out[len++] = '\t';
+			memcpy(out + len, key->str, key->len);
+			len += key->len;
+			out[len++] = '\n';
+			writer->len += len;
+		}
+		break;
+	case OUTPUT_COUNTS:
+		break;
+	}
+}
+
+// Appends a query thread's answers, which come right after the ones already in writer
+void writer_merge(ResultWriter *writer, const ResultWriter *part) {
+	if (output_mode == OUTPUT_BITSET && writer->bit_count != 0) {
+		// Not on a byte boundary, so every byte has to be shifted in
+		for (size_t i = 0; i < part->len; i++) {
+			writer_bits(writer, (unsigned char)part->buf[i], 8);
+		}
+	} else if (writer->fd >= 0 && part->len >= writer->cap - writer->len) {
+		writer_flush(writer);
+		write_all(writer->fd, part->buf, part->len);
+	} else {
+		memcpy(writer_space(writer, part->len), part->buf, part->len);
+		writer->len += part->len;
+	}
+	if (output_mode == OUTPUT_BITSET) {
+		writer_bits(writer, part->bits, part->bit_count);
+	}
+	writer->line += part->lines;
+	writer->lines += part->lines;
+	writer->maybes += part->maybes;
+}
+
+// Writes out whatever is left: the last partial byte of a bitset, or the counts
+void writer_finish(ResultWriter *writer) {
+	if (output_mode == OUTPUT_BITSET && writer->bit_count > 0) {
+		writer_bits(writer, 0, 8 - writer->bit_count);
+	}
+	if (output_mode == OUTPUT_COUNTS) {
+		char *out = writer_space(writer, 128);
+		writer->len += snprintf(out, 128, "lines %llu\nmaybe %llu\nno %llu\n", (unsigned long long)writer->lines,
+			(unsigned long long)writer->maybes, (unsigned long long)(writer->lines - writer->maybes));
+	}
+	writer_flush(writer);
+	free(writer->buf);
+}
+
+// Latency histograms
+/*
+ * HDR-style log-linear histograms of nanoseconds. Values under 64 get a
+ * bucket each; above that every power of two is split into 32 buckets, so a
+ * bucket is never more than ~3% wide and the whole uint64_t range fits in
+ * 1920 buckets. Each query thread records into its own histograms and they
+ * get merged when read, so recording is just a couple of adds.
+ */
+#define LATENCY_SUB_BITS 6
+#define LATENCY_HALF (1 << (LATENCY_SUB_BITS - 1))
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 2) * LATENCY_HALF)
+
+typedef struct {
+	uint64_t counts[LATENCY_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+} LatencyHistogram;
+
+/*
+ * A batch is one filter_check_batch() call. None of its keys has an answer
+ * until the whole batch is done, so each query's latency is the batch time:
+ * query records it once per key, batch once per call.
+ */
+typedef struct {
+	LatencyHistogram query;
+	LatencyHistogram batch;
+} QueryLatency;
+
+int latency_tracking = 0;  // --latency
+
+static double now_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int latency_bucket(uint64_t ns) {
+	if (ns < (1 << LATENCY_SUB_BITS)) {
+		return ns;
+	}
+	int shift = 63 - __builtin_clzll(ns) - (LATENCY_SUB_BITS - 1);
+	return shift * LATENCY_HALF + (ns >> shift);
+}
+
+// The biggest value that lands in bucket
+static uint64_t latency_bucket_top(int bucket) {
+	if (bucket < (1 << LATENCY_SUB_BITS)) {
+		return bucket;
+	}
+	int shift = bucket / LATENCY_HALF - 1;
+	uint64_t mantissa = bucket - shift * LATENCY_HALF;
+	return ((mantissa + 1) << shift) - 1;
+}
+
+void latency_record(LatencyHistogram *histogram, uint64_t ns, uint64_t times) {
+	histogram->counts[latency_bucket(ns)] += times;
+	histogram->total += times;
+	if (ns > histogram->max) {
+		histogram->max = ns;
+	}
+}
+
+void latency_merge(LatencyHistogram *into, const LatencyHistogram *from) {
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		into->counts[i] += from->counts[i];
+	}
+	into->total += from->total;
+	if (from->max > into->max) {
+		into->max = from->max;
+	}
+}
+
+// Records one batch of count keys that started at start (from now_seconds())
+void latency_batch(QueryLatency *latency, double start, int count) {
+	uint64_t ns = (now_seconds() - start) * 1e9;
+	latency_record(&latency->query, ns, count);
+	latency_record(&latency->batch, ns, 1);
+}
+
+// The value below which percentile % of the samples fall, rounded up to its bucket
+uint64_t latency_percentile(const LatencyHistogram *histogram, double percentile) {
+	uint64_t rank = (uint64_t)ceil(histogram->total * percentile / 100);
+	uint64_t seen = 0;
+	if (rank == 0) {
+		rank = 1;
+	}
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += histogram->counts[i];
+		if (seen >= rank) {
+			uint64_t top = latency_bucket_top(i);
+			return top < histogram->max ? top : histogram->max;
+		}
+	}
+	return histogram->max;
+}
+
+// "latency_NAME count ... p50 ... p90 ... p99 ... p99.9 ... max ... ns"
+int latency_line(const char *name, const LatencyHistogram *h, char *text, size_t size) {
+	return snprintf(text, size, "latency_%s count %llu p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu ns\n", name,
+		(unsigned long long)h->total, (unsigned long long)latency_percentile(h, 50),
+		(unsigned long long)latency_percentile(h, 90), (unsigned long long)latency_percentile(h, 99),
+		(unsigned long long)latency_percentile(h, 99.9), (unsigned long long)h->max);
+}
+
+// One line per histogram, query first
+int latency_summary(const QueryLatency *latency, char *text, size_t size) {
+	int len = latency_line("query", &latency->query, text, size);
+	if ((size_t)len < size) {
+		len += latency_line("batch", &latency->batch, text + len, size - len);
+	}
+	return len;
+}
+
+QueryLatency *latency_alloc(void) {
+	QueryLatency *latency = calloc(1, sizeof(*latency));
+	if (latency == NULL) {
+		fprintf(stderr, "Failed to allocate memory for latency histograms\n");
+		exit(1);
+	}
+	return latency;
+}
+
+// Parallel queries
+typedef struct {
+	Filter *filter;
+	LineScanner input;
+	int exact;  // look answers up in the exact-match table
+	int node;   // index into numa_cpus to pin to, or -1
+	Results results;
+	QueryLatency *latency;  // this thread's histograms, NULL without --latency
+	ResultWriter out;       // this thread's answers, merged in order at the end
+} QueryJob;
+
+void *query_worker(void *arg) {
+	QueryJob *job = arg;
+	if (job->node >= 0) {
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &numa_cpus[job->node]);
+	}
+	Key keys[MAX_BATCH_WINDOW];
+	int bloom_results[MAX_BATCH_WINDOW];
+	int count;
+
+	do {
+		count = 0;
+		while (count < batch_window && scanner_next(&job->input, &keys[count])) {
+			count++;
+		}
+		double start = job->latency ? now_seconds() : 0;
+		filter_check_batch(job->filter, keys, count, bloom_results);
+		if (job->latency && count > 0) {
+			latency_batch(job->latency, start, count);
+		}
+		for (int i = 0; i < count; i++) {
+			int actual_present = job->exact && check_word(keys[i].str, keys[i].len);
+			record_result(&job->results, bloom_results[i], actual_present);
+			writer_answer(&job->out, &keys[i], bloom_results[i]);
+		}
+	} while (count == batch_window);
+	return NULL;
+}
+
+/*
+ * Each thread answers one contiguous range of the dictionary into its own
+ * buffer and counters. Writing the buffers out in thread order gives the
+ * same output as the serial loop.
+ */
+void query_parallel(Filter *filter, const LineScanner *input, int threads, int exact, Results *results,
+		QueryLatency *latency, ResultWriter *out) {
+	pthread_t tids[threads];
+	QueryJob jobs[threads];
+
+	// With --numa replicate, thread t reads the copy on node t % numa_nodes
+	int replicas = 0;
+	Filter *copies = NULL;
+	if (numa_mode == NUMA_REPLICATE && numa_nodes > 1) {
+		replicas = threads < numa_nodes ? threads : numa_nodes;
+		copies = malloc(replicas * sizeof(*copies));
+		if (copies == NULL) {
+			fprintf(stderr, "Failed to allocate memory for filter replicas\n");
+			exit(1);
+		}
+		for (int i = 0; i < replicas; i++) {
+			filter_replicate(&copies[i], filter, numa_node_ids[i]);
+		}
+		fprintf(stderr, "NUMA: filter replicated on %d nodes, query threads pinned to their node\n", replicas);
+	}
+
+	uint64_t first_line = out->line;
+	for (int t = 0; t < threads; t++) {
+		Filter *local = replicas ? &copies[t % replicas] : filter;
+		jobs[t] = (QueryJob){local, scanner_slice(input, t, threads), exact, replicas ? t % replicas : -1,
+			{0}, latency ? latency_alloc() : NULL, {0}};
+		writer_init(&jobs[t].out, -1, first_line);
+		if (output_mode == OUTPUT_POSITIVES) {
+			first_line += scanner_count(&jobs[t].input);  // only line numbers need to know where a slice starts
+		}
+		if (pthread_create(&tids[t], NULL, query_worker, &jobs[t]) != 0) {
+			fprintf(stderr, "Failed to start query thread\n");
+			exit(1);
+		}
+	}
+	for (int t = 0; t < threads; t++) {
+		pthread_join(tids[t], NULL);
+		writer_merge(out, &jobs[t].out);
+		free(jobs[t].out.buf);
+		results->true_positive += jobs[t].results.true_positive;
+		results->true_negative += jobs[t].results.true_negative;
+		results->false_positive += jobs[t].results.false_positive;
+		results->false_negative += jobs[t].results.false_negative;
+		if (latency) {
+			latency_merge(&latency->query, &jobs[t].latency->query);
+			latency_merge(&latency->batch, &jobs[t].latency->batch);
+			free(jobs[t].latency);
+		}
+	}
+	for (int i = 0; i < replicas; i++) {
+		filter_free(&copies[i]);
+	}
+	free(copies);
+}
+
+// Profiling
+/*
+ * --profile wraps the build and the queries in hardware counters (through
+ * perf_event_open, user space only, so the default perf_event_paranoid of 2
+ * is enough) and, on the single-threaded paths, times each step of a batch
+ * window separately. Counters inherit into the worker threads.
+ */
+enum {
+	COUNTER_CYCLES,
+	COUNTER_INSTRUCTIONS,
+	COUNTER_LLC_MISSES,
+	COUNTER_DTLB_MISSES,
+	COUNTER_BRANCH_MISSES,
+	COUNTER_COUNT
+};
+
+// Where the time of a phase goes
+enum {
+	STEP_HASH,      // hashing and prefetching (Bloom filters)
+	STEP_ACCESS,    // setting or testing the bits (Bloom filters)
+	STEP_FILTER,    // both at once, for the other filter kinds
+	STEP_EXACT,     // add_word() / check_word()
+	STEP_OUTPUT,    // printing maybe/no
+	STEP_COUNT
+};
+
+typedef struct {
+	const char *name;
+	int fds[COUNTER_COUNT];     // -1 if the counter couldn't be opened or read
+	int errors[COUNTER_COUNT];  // why not: the errno, or 0 if there wasn't one
+	uint64_t counts[COUNTER_COUNT];
+	double start;
+	double seconds;
+	double steps[STEP_COUNT];
+} ProfilePhase;
+
+int profiling = 0;                   // --profile
+ProfilePhase *profile_phase = NULL;  // the phase running now, which the timed loops add to
+
+static const char *counter_names[COUNTER_COUNT] = {
+	"cycles", "instructions", "LLC misses", "dTLB misses", "branch misses"
+};
+
+static const char *step_names[STEP_COUNT] = {
+	"hash", "bit array", "filter", "exact set", "output"
+};
+
+static void open_counter(ProfilePhase *phase, int counter, uint32_t type, uint64_t config) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	phase->fds[counter] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	phase->errors[counter] = phase->fds[counter] < 0 ? errno : 0;
+}
+
+#define CACHE_READ_MISS(cache) \
+	((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+void profile_begin(ProfilePhase *phase, const char *name) {
+	memset(phase, 0, sizeof(*phase));
+	phase->name = name;
+	open_counter(phase, COUNTER_CYCLES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	open_counter(phase, COUNTER_INSTRUCTIONS, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	open_counter(phase, COUNTER_LLC_MISSES, PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL));
+	open_counter(phase, COUNTER_DTLB_MISSES, PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB));
+	open_counter(phase, COUNTER_BRANCH_MISSES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+	for (int i = 0; i < COUNTER_COUNT; i++) {
+		if (phase->fds[i] >= 0) {
+			ioctl(phase->fds[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(phase->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+	profile_phase = phase;
+	phase->start = now_seconds();
+}
+
+// Stops the counters; a counter that was multiplexed gets scaled up to the whole phase
+void profile_end(ProfilePhase *phase) {
+	phase->seconds = now_seconds() - phase->start;
+	profile_phase = NULL;
+	for (int i = 0; i < COUNTER_COUNT; i++) {
+		uint64_t value[3];  // count, time enabled, time running
+		if (phase->fds[i] < 0) {
+			continue;
+		}
+		ioctl(phase->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+		ssize_t n = read(phase->fds[i], value, sizeof(value));
+		phase->errors[i] = n < 0 ? errno : 0;
+		close(phase->fds[i]);
+		if (n == sizeof(value) && value[2] > 0) {
+			phase->counts[i] = (uint64_t)((double)value[0] * value[1] / value[2]);
+		} else {
+			phase->fds[i] = -1;  // report it as unavailable
+		}
+	}
+}
+
+void profile_report(const ProfilePhase *phase, uint64_t keys) {
+	double per_key = keys ? 1.0 / keys : 0;
+	fprintf(stderr, "Profile %s: %llu keys, %.3f s, %.1f ns per key\n", phase->name,
+		(unsigned long long)keys, phase->seconds, phase->seconds * 1e9 * per_key);
+	for (int i = 0; i < COUNTER_COUNT; i++) {
+		if (phase->fds[i] < 0) {
+			// No PMU (common in VMs), or perf_event_paranoid is above 2
+			fprintf(stderr, "  %-14s unavailable (%s)\n", counter_names[i],
+				phase->errors[i] ? strerror(phase->errors[i]) : "couldn't read it");
+			continue;
+		}
+		fprintf(stderr, "  %-14s %14llu  %10.2f per key", counter_names[i],
+			(unsigned long long)phase->counts[i], phase->counts[i] * per_key);
+		if (i == COUNTER_INSTRUCTIONS && phase->fds[COUNTER_CYCLES] >= 0 && phase->counts[COUNTER_CYCLES] > 0) {
+			fprintf(stderr, "  (IPC %.2f)", (double)phase->counts[i] / phase->counts[COUNTER_CYCLES]);
+		}
+		fprintf(stderr, "\n");
+	}
+
+	double timed = 0;
+	for (int i = 0; i < STEP_COUNT; i++) {
+		timed += phase->steps[i];
+	}
+	if (timed == 0) {
+		fprintf(stderr, "  (no time split: only the single-threaded paths are timed step by step)\n");
+		return;
+	}
+	fprintf(stderr, "  time:");
+	for (int i = 0; i < STEP_COUNT; i++) {
+		if (phase->steps[i] > 0) {
+			fprintf(stderr, " %s %.1f%%,", step_names[i], 100 * phase->steps[i] / phase->seconds);
+		}
+	}
+	fprintf(stderr, " other %.1f%%\n", 100 * (phase->seconds - timed) / phase->seconds);
+}
+
+// load_corpus() with each step of a window timed; single-threaded
+void profile_load(Filter *filter, LineScanner *input, int exact, int dedupe) {
+	Key keys[MAX_BATCH_WINDOW];
+	BloomProbe probes[MAX_BATCH_WINDOW];
+	int fresh[MAX_BATCH_WINDOW];
+	double *steps = profile_phase->steps;
+	int count;
+	do {
+		count = 0;
+		while (count < batch_window && scanner_next(input, &keys[count])) {
+			fresh[count++] = 1;
+		}
+		double t0 = now_seconds();
+		if (exact || dedupe) {
+			for (int i = 0; i < count; i++) {
+				fresh[i] = add_word(keys[i].str, keys[i].len);
+			}
+			steps[STEP_EXACT] += now_seconds() - t0;
+			t0 = now_seconds();
+		}
+		if (filter->kind == FILTER_BLOOM) {
+			for (int i = 0; i < count; i++) {
+				bloom_hash(&filter->bloom, keys[i].str, keys[i].len, &probes[i]);
+			}
+			double t1 = now_seconds();
+			for (int i = 0; i < count; i++) {
+				bloom_set(&filter->bloom, &probes[i]);
+				filter->bloom.items++;
+			}
+			steps[STEP_HASH] += t1 - t0;
+			steps[STEP_ACCESS] += now_seconds() - t1;
+		} else {
+			for (int i = 0; i < count; i++) {
+				if (fresh[i] || !dedupe) {
+					filter_add(filter, keys[i].str, keys[i].len);
+				}
+			}
+			steps[STEP_FILTER] += now_seconds() - t0;
+		}
+	} while (count == batch_window);
+	if (filter->kind != FILTER_BLOOM) {
+		double t0 = now_seconds();
+		filter_finish(filter);
+		steps[STEP_FILTER] += now_seconds() - t0;
+	}
+}
+
+// One window of run_queries() with each step timed
+void profile_window(Filter *filter, const Key *keys, int count, int exact, Results *results, ResultWriter *out) {
+	BloomProbe probes[MAX_BATCH_WINDOW];
+	int answers[MAX_BATCH_WINDOW], actual[MAX_BATCH_WINDOW];
+	double *steps = profile_phase->steps;
+
+	double t0 = now_seconds();
+	if (filter->kind == FILTER_BLOOM) {
+		for (int i = 0; i < count; i++) {
+			bloom_hash(&filter->bloom, keys[i].str, keys[i].len, &probes[i]);
+			bloom_prefetch(&filter->bloom, &probes[i]);
+		}
+		double t1 = now_seconds();
+		for (int i = 0; i < count; i++) {
+			answers[i] = bloom_test(&filter->bloom, &probes[i]);
+		}
+		steps[STEP_HASH] += t1 - t0;
+		steps[STEP_ACCESS] += now_seconds() - t1;
+	} else {
+		filter_check_batch(filter, keys, count, answers);
+		steps[STEP_FILTER] += now_seconds() - t0;
+	}
+
+	t0 = now_seconds();
+	for (int i = 0; i < count; i++) {
+		actual[i] = exact && check_word(keys[i].str, keys[i].len);
+	}
+	double t1 = now_seconds();
+	for (int i = 0; i < count; i++) {
+		record_result(results, answers[i], actual[i]);
+		writer_answer(out, &keys[i], answers[i]);
+	}
+	steps[STEP_EXACT] += exact ? t1 - t0 : 0;
+	steps[STEP_OUTPUT] += now_seconds() - t1;
+}
+
+// Build and query drivers
+/*
+ * Adds every line of input to the filter (and the exact-match table if exact
+ * is set). Only a plain Bloom filter builds in parallel; the other kinds
+ * decide where a key goes based on the ones before it. A cuckoo filter only
+ * gets each distinct word once, so repeated lines go through the word set
+ * first (a temporary one if there's no exact-match table).
+ */
+void load_corpus(Filter *filter, LineScanner *input, int threads, int exact) {
+	ProfilePhase phase;
+	if (profiling) {
+		profile_begin(&phase, "build");
+	}
+	int dedupe = filter->kind == FILTER_CUCKOO;
+	if (dedupe && !exact) {
+		init_word_set();
+	}
+
+	if (threads > 1 && filter->kind == FILTER_BLOOM) {
+		bloom_build_parallel(&filter->bloom, input, threads, exact);
+	} else if (profiling) {
+		profile_load(filter, input, exact, dedupe);
+	} else {
+		Key line;
+		while (scanner_next(input, &line)) {
+			int fresh = exact || dedupe ? add_word(line.str, line.len) : 1;
+			if (fresh || !dedupe) {
+				filter_add(filter, line.str, line.len);
+			}
+		}
+		filter_finish(filter);
+	}
+
+	if (dedupe && !exact) {
+		free_word_set();
+	}
+
+	if (profiling) {
+		profile_end(&phase);
+		profile_report(&phase, scanner_count(input));
+	}
+}
+
+/*
+ * --remove: takes every line of path back out of the filter and the
+ * exact-match table, so the stats treat those words as never added. Words
+ * the table doesn't have are skipped, since removing a word that was never
+ * added would take out some other word's bits or fingerprint.
+ */
+int remove_corpus(Filter *filter, const char *path) {
+	LineScanner words;
+	if (scanner_open(&words, path) < 0) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return -1;
+	}
+	uint64_t changed = 0, missing = 0;
+	Key word;
+	while (scanner_next(&words, &word)) {
+		if (remove_word(word.str, word.len) && filter_remove(filter, word.str, word.len)) {
+			changed++;
+		} else {
+			missing++;
+		}
+	}
+	scanner_close(&words);
+	fprintf(stderr, "Removed %llu words (%llu weren't in rockyou)\n", (unsigned long long)changed,
+		(unsigned long long)missing);
+	return 0;
+}
+
+// Prints the answer for every line of input (see --output); without exact, only bloom answers are meaningful
+void run_queries(Filter *filter, LineScanner *input, int threads, int exact, Results *results) {
+	ProfilePhase phase;
+	if (profiling) {
+		profile_begin(&phase, "query");
+	}
+	if (numa_mode != NUMA_OFF) {
+		numa_discover();
+		if (numa_nodes < 2) {
+			fprintf(stderr, "NUMA: only one node, --numa has nothing to do\n");
+		} else if (numa_mode == NUMA_INTERLEAVE) {
+			filter_interleave(filter);
+		} else if (threads < 2) {
+			fprintf(stderr, "NUMA: --numa replicate needs --threads 2 or more\n");
+		}
+	}
+
+	QueryLatency *latency = latency_tracking ? latency_alloc() : NULL;
+	ResultWriter out;
+	fflush(stdout);  // the writer goes around stdio
+	writer_init(&out, STDOUT_FILENO, 1);
+	if (threads > 1) {
+		query_parallel(filter, input, threads, exact, results, latency, &out);
+	} else {
+		// Take a window of words at a time so the filter can check them as a batch
+		Key keys[MAX_BATCH_WINDOW];
+		int bloom_results[MAX_BATCH_WINDOW];
+		int count;
+		do {
+			count = 0;
+			while (count < batch_window && scanner_next(input, &keys[count])) {
+				count++;
+			}
+			if (profiling) {
+				profile_window(filter, keys, count, exact, results, &out);
+				continue;
+			}
+			double start = latency ? now_seconds() : 0;
+			filter_check_batch(filter, keys, count, bloom_results);
+			if (latency && count > 0) {
+				latency_batch(latency, start, count);
+			}
+
+			for (int i = 0; i < count; i++) {
+				int actual_present = exact && check_word(keys[i].str, keys[i].len);
+				record_result(results, bloom_results[i], actual_present);
+				writer_answer(&out, &keys[i], bloom_results[i]);
+			}
+		} while (count == batch_window);
+	}
+
+	if (profiling) {
+		double start = now_seconds();
+		writer_finish(&out);
+		profile_phase->steps[STEP_OUTPUT] += now_seconds() - start;
+	} else {
+		writer_finish(&out);
+	}
+	if (latency) {
+		char text[512];
+		latency_summary(latency, text, sizeof(text));
+		fprintf(stderr, "%s", text);
+		free(latency);
+	}
+	if (profiling) {
+		profile_end(&phase);
+		profile_report(&phase, scanner_count(input));
+	}
+}
+
+// Sampled evaluation
+/*
+ * --sample N estimates the accuracy stats without the exact-match table.
+ * N dictionary lines are picked by reservoir sampling (algorithm R, with a
+ * fixed seed so runs repeat), and a second pass over rockyou finds out which
+ * of them are really in it. That takes memory for N keys instead of all of
+ * rockyou. The counts are scaled up to the whole dictionary, with 95% Wilson
+ * score intervals.
+ */
+#define SAMPLE_SEED 1
+#define SAMPLE_Z 1.96  // 95% confidence
+
+typedef struct {
+	Key key;
+	uint64_t hash;
+	int answer;   // what the filter said
+	int present;  // whether rockyou really has it
+} Sample;
+
+static int compare_samples(const void *a, const void *b) {
+	uint64_t x = ((const Sample *)a)->hash, y = ((const Sample *)b)->hash;
+	return x < y ? -1 : x > y;
+}
+
+// Wilson score interval for the proportion hits / n
+static void wilson_interval(uint64_t hits, uint64_t n, double *low, double *high) {
+	if (n == 0) {
+		*low = 0;
+		*high = 1;
+		return;
+	}
+	double p = (double)hits / n, z2 = SAMPLE_Z * SAMPLE_Z;
+	double denominator = 1 + z2 / n;
+	double center = (p + z2 / (2.0 * n)) / denominator;
+	double half = SAMPLE_Z * sqrt(p * (1 - p) / n + z2 / (4.0 * n * n)) / denominator;
+	*low = fmax(0, center - half);
+	*high = fmin(1, center + half);
+}
+
+// One stat scaled up from the sample; a sample of everything is exact, so no interval
+static void print_estimate(FILE *out, const char *label, uint64_t hits, uint64_t n, uint64_t total) {
+	if (n == total) {
+		fprintf(out, "%s: %llu\n", label, (unsigned long long)hits);
+		return;
+	}
+	double low, high;
+	wilson_interval(hits, n, &low, &high);
+	fprintf(out, "%s: ~%.0f (95%% CI %.0f-%.0f)\n", label, (double)hits / n * total, low * total, high * total);
+}
+
+void sample_results(Filter *filter, const LineScanner *queries, const LineScanner *corpus, uint64_t size, FILE *out) {
+	uint64_t lines = scanner_count(queries);
+	if (size > lines) {
+		size = lines;  // a --sample bigger than the dictionary is just all of it
+	}
+	Sample *samples = malloc((size ? size : 1) * sizeof(*samples));
+	if (samples == NULL) {
+		fprintf(stderr, "Failed to allocate memory for %llu samples\n", (unsigned long long)size);
+		exit(1);
+	}
+
+	// Keep the first size lines, then line i replaces a random one with probability size / (i + 1)
+	LineScanner input = {queries->data, queries->size, 0};
+	uint64_t seen = 0, count = 0;
+	Key key;
+	while (scanner_next(&input, &key)) {
+		if (count < size) {
+			samples[count++].key = key;
+		} else {
+			uint64_t slot = fastrange64(mix64(SAMPLE_SEED + seen * 0x9E3779B97F4A7C15ULL), seen + 1);
+			if (slot < size) {
+				samples[slot].key = key;
+			}
+		}
+		seen++;
+	}
+
+	// Ask the filter about them in windows, the same as the real queries
+	Key keys[MAX_BATCH_WINDOW];
+	int answers[MAX_BATCH_WINDOW];
+	for (uint64_t i = 0; i < count; i += batch_window) {
+		int n = count - i < (uint64_t)batch_window ? (int)(count - i) : batch_window;
+		for (int j = 0; j < n; j++) {
+			keys[j] = samples[i + j].key;
+		}
+		filter_check_batch(filter, keys, n, answers);
+		for (int j = 0; j < n; j++) {
+			uint64_t hash[2];
+			hash_wyhash(keys[j].str, keys[j].len, 0, hash);  // only for matching, so always the fast one
+			samples[i + j] = (Sample){keys[j], hash[0], answers[j], 0};
+		}
+	}
+	qsort(samples, count, sizeof(*samples), compare_samples);
+
+	// Second pass: look every corpus line up among the samples
+	LineScanner pass = {corpus->data, corpus->size, 0};
+	while (count > 0 && scanner_next(&pass, &key)) {
+		uint64_t hash[2];
+		hash_wyhash(key.str, key.len, 0, hash);
+		size_t low = 0, high = count;
+		while (low < high) {
+			size_t mid = low + (high - low) / 2;
+			if (samples[mid].hash < hash[0]) low = mid + 1;
+			else high = mid;
+		}
+		// The same word can be sampled more than once
+		for (; low < count && samples[low].hash == hash[0]; low++) {
+			if (samples[low].key.len == key.len && memcmp(samples[low].key.str, key.str, key.len) == 0) {
+				samples[low].present = 1;
+			}
+		}
+	}
+
+	Results sampled = {0};
+	for (uint64_t i = 0; i < count; i++) {
+		record_result(&sampled, samples[i].answer, samples[i].present);
+	}
+	free(samples);
+
+	fprintf(out, "Sampled %llu of %llu queries, checked against %s in a second pass\n",
+		(unsigned long long)count, (unsigned long long)seen, count == seen ? "the whole corpus (exact)" : "the corpus");
+	print_estimate(out, "True Positives", sampled.true_positive, count, seen);
+	print_estimate(out, "True Negatives", sampled.true_negative, count, seen);
+	print_estimate(out, "False Positives", sampled.false_positive, count, seen);
+	print_estimate(out, "False Negatives", sampled.false_negative, count, seen);
+
+	uint64_t negatives = sampled.false_positive + sampled.true_negative;
+	double low, high;
+	wilson_interval(sampled.false_positive, negatives, &low, &high);
+	fprintf(out, "False Positive Rate: %.4f%% (95%% CI %.4f%%-%.4f%%, %llu sampled negatives)\n",
+		negatives ? 100.0 * sampled.false_positive / negatives : 0, 100 * low, 100 * high,
+		(unsigned long long)negatives);
+}
+
+// Filter files
+/*
+ * On-disk layout: a BloomFileHeader, zero padding up to array_offset (a page
+ * boundary, so the mmapped array is page and cache-line aligned), the bit
+ * array, then an XXH64 checksum of the array. All fields are little-endian.
+ */
+#define BLOOM_FILE_MAGIC "BLOOMFLT"
+#define BLOOM_FILE_VERSION 3
+#define BLOOM_FILE_VERSION_OLD 2  // same format, but its enhanced probes were really double hashing
+#define BLOOM_FILE_ALIGN 4096
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t size_bits;
+	uint32_t hash_count;
+	uint32_t scheme;
+	uint32_t layout;
+	char engine[16];
+	uint32_t reserved;
+	uint64_t items;
+	uint64_t array_offset;
+	uint64_t array_bytes;
+} BloomFileHeader;
+
+int bloom_save(const BloomFilter *filter, const char *path) {
+	BloomFileHeader header = {0};
+	memcpy(header.magic, BLOOM_FILE_MAGIC, sizeof(header.magic));
+	header.version = BLOOM_FILE_VERSION;
+	header.header_size = sizeof(header);
+	header.size_bits = filter->size;
+	header.hash_count = filter->hash_count;
+	header.scheme = filter->scheme;
+	header.layout = filter->layout;
+	strncpy(header.engine, filter->engine->name, sizeof(header.engine) - 1);
+	header.items = filter->items;
+	header.array_offset = BLOOM_FILE_ALIGN;
+	header.array_bytes = bloom_bytes(filter->size, filter->layout);
+	uint64_t checksum = xxh64(filter->array, header.array_bytes, 0);
+
+	FILE *file = fopen(path, "wb");
+	if (file == NULL) {
+		return -1;
+	}
+	static const char padding[BLOOM_FILE_ALIGN];
+	int ok = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(padding, header.array_offset - sizeof(header), 1, file) == 1
+		&& fwrite(filter->array, header.array_bytes, 1, file) == 1
+		&& fwrite(&checksum, sizeof(checksum), 1, file) == 1;
+	if (fclose(file) != 0) {
+		ok = 0;
+	}
+	return ok ? 0 : -1;
+}
+
+/*
+ * Maps a filter file; the filter's array points straight into the mapping.
+ * With writable set, changes go back to the file (call bloom_sync() after).
+ */
+int bloom_load(BloomFilter *filter, const char *path, int writable) {
+	int fd = open(path, writable ? O_RDWR : O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(BloomFileHeader)) {
+		fprintf(stderr, "%s is not a filter file\n", path);
+		close(fd);
+		return -1;
+	}
+	void *map = mmap(NULL, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map %s\n", path);
+		return -1;
+	}
+
+	const BloomFileHeader *header = map;
+	const char *error = NULL;
+	if (memcmp(header->magic, BLOOM_FILE_MAGIC, sizeof(header->magic)) != 0) {
+		error = "not a filter file";
+	} else if ((header->version != BLOOM_FILE_VERSION && header->version != BLOOM_FILE_VERSION_OLD)
+			|| header->header_size != sizeof(*header)) {
+		error = "unsupported filter file version";
+	} else if (header->size_bits < BLOCK_BITS || header->size_bits > MAX_BLOOM_SIZE
+			|| header->hash_count < 1 || header->hash_count > MAX_HASH_COUNT) {
+		error = "bad filter size or hash count";
+	} else if (header->scheme > PROBE_ENHANCED || header->layout > LAYOUT_COUNTING) {
+		error = "unknown probe scheme or layout";
+	} else if (header->array_bytes > MAX_BLOOM_SIZE  // so the multiply below can't wrap
+			|| header->size_bits > header->array_bytes * 8 / bloom_cell_bits(header->layout)
+			|| header->array_bytes != bloom_bytes(header->size_bits, header->layout)
+			|| header->array_offset < sizeof(*header)
+			|| header->array_offset % BLOOM_FILE_ALIGN != 0
+			|| header->array_offset > (uint64_t)st.st_size - sizeof(uint64_t)  // one field at a time so nothing wraps
+			|| header->array_bytes > (uint64_t)st.st_size - sizeof(uint64_t) - header->array_offset) {
+		error = "truncated or corrupt filter file";
+	} else if (memchr(header->engine, '\0', sizeof(header->engine)) == NULL
+			|| find_hash_engine(header->engine) == NULL) {
+		error = "unknown hash engine";
+	}
+
+	unsigned char *array = (unsigned char *)map + (error ? 0 : header->array_offset);
+	if (error == NULL) {
+		uint64_t checksum;
+		memcpy(&checksum, array + header->array_bytes, sizeof(checksum));
+		if (xxh64(array, header->array_bytes, 0) != checksum) {
+			error = "checksum mismatch";
+		}
+	}
+	if (error != NULL) {
+		fprintf(stderr, "Failed to load %s: %s\n", path, error);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	filter->array = array;
+	filter->size = header->size_bits;
+	filter->hash_count = header->hash_count;
+	filter->scheme = header->scheme;
+	if (header->version == BLOOM_FILE_VERSION_OLD && filter->scheme == PROBE_ENHANCED) {
+		filter->scheme = PROBE_DOUBLE;  // the bits it was built with
+	}
+	filter->layout = header->layout;
+	filter->engine = find_hash_engine(header->engine);
+	filter->split = split_kernel();
+	filter->items = header->items;
+	filter->mapping = map;
+	filter->mapping_size = st.st_size;
+	filter->pages = PAGES_DEFAULT;
+	return 0;
+}
+
+// Writes the item count and a fresh checksum back into a writable mapped filter
+int bloom_sync(BloomFilter *filter) {
+	BloomFileHeader *header = filter->mapping;
+	uint64_t checksum = xxh64(filter->array, header->array_bytes, 0);
+	header->items = filter->items;
+	memcpy(filter->array + header->array_bytes, &checksum, sizeof(checksum));
+	return msync(filter->mapping, filter->mapping_size, MS_SYNC);
+}
+
+// Benchmark
+/*
+ * Synthetic keys for `bench`: random letters and digits with lengths drawn
+ * uniformly from a shape's range. Inserted keys start with 'p' and the ones
+ * used for negative lookups with 'n', so the two sets never overlap.
+ */
+typedef struct {
+	const char *name;
+	int min_len;
+	int max_len;
+} KeyShape;
+
+static const KeyShape key_shapes[] = {
+	{"short", 6, 10},     // typical passwords
+	{"medium", 8, 32},
+	{"long", 64, 128},    // passphrases, hashes, URLs
+};
+
+#define BENCH_DEFAULT_ITEMS (1 << 20)
+
+// n keys, one per line, as one buffer a LineScanner can read
+char *bench_keys(size_t n, const KeyShape *shape, char prefix, uint64_t seed, size_t *size) {
+	static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+	char *buffer = malloc(n * (shape->max_len + 1));
+	if (buffer == NULL) {
+		fprintf(stderr, "Failed to allocate memory for benchmark keys\n");
+		exit(1);
+	}
+	char *p = buffer;
+	for (size_t i = 0; i < n; i++) {
+		uint64_t r = mix64(seed + i * 0x9E3779B97F4A7C15ULL);
+		int len = shape->min_len + r % (shape->max_len - shape->min_len + 1);
+		*p++ = prefix;
+		for (int j = 1; j < len; j++) {
+			r = mix64(r + j);
+			*p++ = alphabet[r % (sizeof(alphabet) - 1)];
+		}
+		*p++ = '\n';
+	}
+	*size = p - buffer;
+	return buffer;
+}
+
+typedef struct {
+	Filter *filter;
+	const Key *keys;
+	size_t n;
+	uint64_t hits;
+} BenchJob;
+
+void *bench_worker(void *arg) {
+	BenchJob *job = arg;
+	int results[MAX_BATCH_WINDOW];
+	for (size_t start = 0; start < job->n; start += batch_window) {
+		size_t count = job->n - start < (size_t)batch_window ? job->n - start : (size_t)batch_window;
+		filter_check_batch(job->filter, job->keys + start, count, results);
+		for (size_t i = 0; i < count; i++) {
+			job->hits += results[i];
+		}
+	}
+	return NULL;
+}
+
+// Looks up keys[0..n) on threads threads; returns the wall time and adds up the hits
+double bench_lookups(Filter *filter, const Key *keys, size_t n, int threads, uint64_t *hits) {
+	pthread_t tids[threads];
+	BenchJob jobs[threads];
+	double start = now_seconds();
+	for (int t = 0; t < threads; t++) {
+		size_t first = n * t / threads, last = n * (t + 1) / threads;
+		jobs[t] = (BenchJob){filter, keys + first, last - first, 0};
+		if (pthread_create(&tids[t], NULL, bench_worker, &jobs[t]) != 0) {
+			fprintf(stderr, "Failed to start benchmark thread\n");
+			exit(1);
+		}
+	}
+	*hits = 0;
+	for (int t = 0; t < threads; t++) {
+		pthread_join(tids[t], NULL);
+		*hits += jobs[t].hits;
+	}
+	return now_seconds() - start;
+}
+
+/*
+ * Sets wanted[i] for every key_shapes name in the comma-separated text.
+ * Unknown names (and an empty list) are an error rather than an empty run.
+ */
+int parse_key_shapes(const char *text, int *wanted) {
+	size_t shape_count = sizeof(key_shapes) / sizeof(key_shapes[0]);
+	int any = 0;
+	memset(wanted, 0, shape_count * sizeof(*wanted));
+	while (*text != '\0') {
+		size_t len = strcspn(text, ",");
+		size_t s = 0;
+		while (s < shape_count && (strlen(key_shapes[s].name) != len || strncmp(text, key_shapes[s].name, len) != 0)) {
+			s++;
+		}
+		if (s == shape_count) {
+			fprintf(stderr, "Unknown key shape: %.*s (use short, medium or long)\n", (int)len, text);
+			return -1;
+		}
+		wanted[s] = any = 1;
+		text += len + (text[len] == ',');
+	}
+	if (!any) {
+		fprintf(stderr, "--sweep-keys needs at least one key shape\n");
+		return -1;
+	}
+	return 0;
+}
+
+// Splits a comma-separated list of numbers into values, returns how many
+int parse_list(const char *text, int *values, int max) {
+	int count = 0;
+	while (count < max) {
+		char *end;
+		long value = strtol(text, &end, 10);
+		if (end == text) {
+			break;
+		}
+		values[count++] = value;
+		if (*end != ',') {
+			break;
+		}
+		text = end + 1;
+	}
+	return count;
+}
+
+// Server
+/*
+ * `serve` answers lookups over a Unix socket or loopback TCP with one epoll
+ * loop. Every message, both ways, is a little-endian u32 payload length
+ * followed by the payload, and the first payload byte is the opcode/status:
+ *   query: [u8 SERVE_QUERY] then keys as [u16 length][bytes], repeated
+ *          -> [u8 SERVE_OK][u32 count][count bytes, 1 = maybe, 0 = no]
+ *   stats: [u8 SERVE_STATS] -> [u8 SERVE_OK][text]
+ *   anything malformed -> [u8 SERVE_ERROR][text], then the connection is closed
+ * Clients can pipeline: every complete request in a read gets answered, in
+ * order, and all of their keys go through the filter as one batch.
+ */
+#define SERVE_QUERY 1
+#define SERVE_STATS 2
+#define SERVE_OK 0
+#define SERVE_ERROR 1
+#define SERVE_MAX_MESSAGE (1 << 20)
+#define SERVE_MAX_EVENTS 64
+#define SERVE_READ_CHUNK 65536
+#define SERVE_READ_LIMIT (2 * SERVE_MAX_MESSAGE)    // per connection per wakeup, so one client can't hog the loop
+#define SERVE_MAX_PENDING (4 * SERVE_MAX_MESSAGE)   // unsent replies before we stop reading that client
+
+typedef struct {
+	int fd;
+	char *in;          // bytes read but not handled yet
+	size_t in_len;
+	size_t in_cap;
+	char *out;         // responses not written yet
+	size_t out_len;
+	size_t out_cap;
+	size_t out_sent;
+	int closing;       // close once out is flushed (after an error or the client's EOF)
+} Connection;
+
+typedef struct {
+	double started;
+	uint64_t connections;
+	uint64_t requests;
+	uint64_t keys;
+	uint64_t positives;
+	uint64_t errors;
+	QueryLatency latency;       // the filter lookups, one batch per read
+	LatencyHistogram request;   // each request from when its read is handled to its reply being queued
+} ServerStats;
+
+static volatile sig_atomic_t serve_stop = 0;
+
+static void serve_signal(int sig) {
+	(void)sig;
+	serve_stop = 1;
+}
+
+static void send_message(Connection *conn, uint8_t status, const void *data, size_t len) {
+	uint32_t length = len + 1;
+	reserve(&conn->out, &conn->out_cap, conn->out_len, 4 + length);
+	memcpy(conn->out + conn->out_len, &length, 4);
+	conn->out[conn->out_len + 4] = status;
+	memcpy(conn->out + conn->out_len + 5, data, len);
+	conn->out_len += 4 + length;
+}
+
+static void send_error(Connection *conn, ServerStats *stats, const char *text) {
+	send_message(conn, SERVE_ERROR, text, strlen(text));
+	conn->closing = 1;
+	stats->errors++;
+}
+
+void serve_stats_text(const ServerStats *stats, char *text, size_t size) {
+	int len = snprintf(text, size, "uptime_s %.3f\nconnections %llu\nrequests %llu\nkeys %llu\npositives %llu\nerrors %llu\n",
+		now_seconds() - stats->started, (unsigned long long)stats->connections,
+		(unsigned long long)stats->requests, (unsigned long long)stats->keys,
+		(unsigned long long)stats->positives, (unsigned long long)stats->errors);
+	if ((size_t)len < size) {
+		len += latency_summary(&stats->latency, text + len, size - len);
+	}
+	if ((size_t)len < size) {
+		latency_line("request", &stats->request, text + len, size - len);
+	}
+}
+
+/*
+ * Handles every complete request in conn->in. The keys of all the queries
+ * are collected first (as views into conn->in) and checked with one
+ * filter_check_batch() call, then the answers go out in request order.
+ * A request's latency runs from the start of parsing until its reply is
+ * queued, so it includes waiting for the requests pipelined ahead of it.
+ */
+void serve_requests(Filter *filter, Connection *conn, ServerStats *stats) {
+	static Key *keys = NULL;
+	static int *answers = NULL;
+	static size_t keys_cap = 0;
+	size_t key_count = 0;
+	double parsed = now_seconds();
+
+	// Pass 1: find the complete requests and pull out their keys
+	size_t pos = 0, end = 0;
+	while (!conn->closing && conn->in_len - pos >= 4) {
+		uint32_t length;
+		memcpy(&length, conn->in + pos, 4);
+		if (length == 0 || length > SERVE_MAX_MESSAGE) {
+			break;  // pass 2 reports it
+		}
+		if (conn->in_len - pos - 4 < length) {
+			break;
+		}
+		const unsigned char *payload = (const unsigned char *)conn->in + pos + 4;
+		if (payload[0] == SERVE_QUERY) {
+			for (size_t at = 1; at + 2 <= length; ) {
+				uint16_t len;
+				memcpy(&len, payload + at, 2);
+				if (at + 2 + len > length) {
+					break;
+				}
+				if (key_count == keys_cap) {
+					keys_cap = keys_cap ? keys_cap * 2 : 1024;
+					keys = realloc(keys, keys_cap * sizeof(*keys));
+					answers = realloc(answers, keys_cap * sizeof(*answers));
+					if (keys == NULL || answers == NULL) {
+						fprintf(stderr, "Failed to allocate memory for server keys\n");
+						exit(1);
+					}
+				}
+				keys[key_count++] = (Key){(const char *)payload + at + 2, len};
+				at += 2 + len;
+			}
+		}
+		pos += 4 + length;
+	}
+	end = pos;
+	double start = now_seconds();
+	filter_check_batch(filter, keys, key_count, answers);
+	if (key_count > 0) {
+		latency_batch(&stats->latency, start, key_count);
+	}
+
+	// Pass 2: answer them in order
+	size_t next = 0;
+	for (pos = 0; pos < end; ) {
+		uint32_t length;
+		memcpy(&length, conn->in + pos, 4);
+		const unsigned char *payload = (const unsigned char *)conn->in + pos + 4;
+		pos += 4 + length;
+		stats->requests++;
+
+		if (payload[0] == SERVE_STATS) {
+			char text[2048];
+			serve_stats_text(stats, text, sizeof(text));
+			send_message(conn, SERVE_OK, text, strlen(text));
+			latency_record(&stats->request, (now_seconds() - parsed) * 1e9, 1);
+			continue;
+		}
+		if (payload[0] != SERVE_QUERY) {
+			send_error(conn, stats, "unknown request");
+			break;
+		}
+		// Same walk as pass 1, to count this request's keys and check it was well formed
+		uint32_t count = 0;
+		size_t at = 1;
+		while (at + 2 <= length) {
+			uint16_t len;
+			memcpy(&len, payload + at, 2);
+			if (at + 2 + len > length) {
+				break;
+			}
+			at += 2 + len;
+			count++;
+		}
+		if (at != length) {
+			send_error(conn, stats, "malformed query");
+			break;
+		}
+		reserve(&conn->out, &conn->out_cap, conn->out_len, 9 + count);
+		uint32_t reply_length = 5 + count;
+		char *reply = conn->out + conn->out_len;
+		memcpy(reply, &reply_length, 4);
+		reply[4] = SERVE_OK;
+		memcpy(reply + 5, &count, 4);
+		for (uint32_t i = 0; i < count; i++) {
+			reply[9 + i] = answers[next + i];
+			stats->positives += answers[next + i];
+		}
+		conn->out_len += 4 + reply_length;
+		stats->keys += count;
+		next += count;
+		latency_record(&stats->request, (now_seconds() - parsed) * 1e9, 1);
+	}
+
+	// A bad length can't be skipped over, so it ends the connection
+	if (!conn->closing && conn->in_len - end >= 4) {
+		uint32_t length;
+		memcpy(&length, conn->in + end, 4);
+		if (length == 0 || length > SERVE_MAX_MESSAGE) {
+			send_error(conn, stats, "bad message length");
+		}
+	}
+	memmove(conn->in, conn->in + end, conn->in_len - end);
+	conn->in_len -= end;
+}
+
+// Writes as much pending output as the socket takes; returns -1 if the connection is dead
+int serve_flush(Connection *conn) {
+	while (conn->out_sent < conn->out_len) {
+		ssize_t n = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+		if (n < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		conn->out_sent += n;
+	}
+	conn->out_len = conn->out_sent = 0;
+	return 0;
+}
+
+void serve_close(int epoll_fd, Connection *conn) {
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	free(conn->in);
+	free(conn->out);
+	free(conn);
+}
+
+/*
+ * Removes a stale socket file at path. Anything else there (say a filter file
+ * passed to --listen by mistake) is left alone and reported. Returns 0 if the
+ * path is free now, -1 if not.
+ */
+int unlink_socket(const char *path) {
+	struct stat st;
+	if (lstat(path, &st) < 0) {
+		if (errno == ENOENT) {
+			return 0;
+		}
+	} else if (!S_ISSOCK(st.st_mode)) {
+		fprintf(stderr, "%s exists and isn't a socket, so it won't be removed\n", path);
+		return -1;
+	} else if (unlink(path) == 0) {
+		return 0;
+	}
+	fprintf(stderr, "Failed to remove %s: %s\n", path, strerror(errno));
+	return -1;
+}
+
+/*
+ * Listens on a Unix socket at path, or on host:port if address has a colon.
+ * TCP is loopback only (127.0.0.0/8) unless allow_remote is set, since
+ * there's no authentication.
+ */
+int serve_listen(const char *address, int allow_remote) {
+	int fd;
+	const char *colon = strrchr(address, ':');
+	if (colon == NULL) {
+		struct sockaddr_un addr = {.sun_family = AF_UNIX};
+		if (strlen(address) >= sizeof(addr.sun_path)) {
+			fprintf(stderr, "Socket path too long: %s\n", address);
+			return -1;
+		}
+		strcpy(addr.sun_path, address);
+		if (unlink_socket(address) < 0) {
+			return -1;
+		}
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			fprintf(stderr, "Failed to listen on %s: %s\n", address, strerror(errno));
+			return -1;
+		}
+	} else {
+		char host[64], *end;
+		snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+		errno = 0;
+		long port = strtol(colon + 1, &end, 10);
+		if (end == colon + 1 || *end != '\0' || errno != 0 || port < 1 || port > 65535) {
+			fprintf(stderr, "Bad port in %s (use 1 to 65535)\n", address);
+			return -1;
+		}
+		struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+		if (inet_pton(AF_INET, host[0] ? host : "127.0.0.1", &addr.sin_addr) != 1) {
+			fprintf(stderr, "Bad listen address: %s\n", address);
+			return -1;
+		}
+		if ((ntohl(addr.sin_addr.s_addr) >> 24) != 127 && !allow_remote) {
+			fprintf(stderr, "%s isn't a loopback address; pass --allow-remote to listen on it anyway\n", host);
+			return -1;
+		}
+		int one = 1;
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (fd >= 0) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		}
+		if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			fprintf(stderr, "Failed to listen on %s: %s\n", address, strerror(errno));
+			return -1;
+		}
+	}
+	if (listen(fd, SOMAXCONN) < 0) {
+		fprintf(stderr, "Failed to listen on %s: %s\n", address, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Runs until SIGINT or SIGTERM
+int serve_loop(Filter *filter, int listen_fd) {
+	int epoll_fd = epoll_create1(0);
+	struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};  // NULL marks the listener
+	if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) < 0) {
+		fprintf(stderr, "Failed to set up epoll: %s\n", strerror(errno));
+		return -1;
+	}
+	signal(SIGINT, serve_signal);
+	signal(SIGTERM, serve_signal);
+	static ServerStats stats;  // too big for the stack with its histograms
+	stats = (ServerStats){.started = now_seconds()};
+	struct epoll_event events[SERVE_MAX_EVENTS];
+
+	while (!serve_stop) {
+		int ready = epoll_wait(epoll_fd, events, SERVE_MAX_EVENTS, -1);
+		if (ready < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+			break;
+		}
+		for (int e = 0; e < ready; e++) {
+			Connection *conn = events[e].data.ptr;
+			if (conn == NULL) {
+				int fd;
+				while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+					int one = 1;
+					setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));  // fails harmlessly on Unix sockets
+					conn = calloc(1, sizeof(*conn));
+					if (conn == NULL) {
+						close(fd);
+						continue;
+					}
+					conn->fd = fd;
+					struct epoll_event add = {.events = EPOLLIN, .data.ptr = conn};
+					epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &add);
+					stats.connections++;
+				}
+				continue;
+			}
+
+			int dead = (events[e].events & (EPOLLERR | EPOLLHUP)) && !(events[e].events & EPOLLIN);
+			if (!dead && (events[e].events & EPOLLIN)) {
+				/*
+				 * Read a chunk at a time and answer what's complete after each one, up to
+				 * SERVE_READ_LIMIT per wakeup (epoll is level-triggered, so the rest waits
+				 * for the next round). conn->in never holds more than one partial message
+				 * and a chunk, and reading stops while replies pile up unsent.
+				 */
+				size_t budget = SERVE_READ_LIMIT;
+				while (budget > 0 && !conn->closing && conn->out_len < SERVE_MAX_PENDING) {
+					reserve(&conn->in, &conn->in_cap, conn->in_len, SERVE_READ_CHUNK);
+					ssize_t n = recv(conn->fd, conn->in + conn->in_len, SERVE_READ_CHUNK, 0);
+					if (n > 0) {
+						conn->in_len += n;
+						budget -= n < (ssize_t)budget ? (size_t)n : budget;
+						serve_requests(filter, conn, &stats);
+						continue;
+					}
+					if (n == 0) {
+						conn->closing = 1;  // the client is done sending; finish the replies, then close
+					} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+						dead = 1;
+					}
+					break;
+				}
+			}
+			if (dead || serve_flush(conn) < 0 || (conn->closing && conn->out_len == 0)) {
+				serve_close(epoll_fd, conn);
+				continue;
+			}
+			// Only wait for writability while there's something left to write, and stop
+			// reading from a client that's closing or isn't picking up its replies
+			uint32_t wanted = conn->out_len ? EPOLLOUT : 0;
+			if (!conn->closing && conn->out_len < SERVE_MAX_PENDING) {
+				wanted |= EPOLLIN;
+			}
+			struct epoll_event mod = {.events = wanted, .data.ptr = conn};
+			epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &mod);
+		}
+	}
+	close(epoll_fd);
+	fprintf(stderr, "Served %llu requests (%llu keys) on %llu connections\n", (unsigned long long)stats.requests,
+		(unsigned long long)stats.keys, (unsigned long long)stats.connections);
+	char text[512];
+	int len = latency_summary(&stats.latency, text, sizeof(text));
+	if ((size_t)len < sizeof(text)) {
+		latency_line("request", &stats.request, text + len, sizeof(text) - len);
+	}
+	fprintf(stderr, "%s", text);
+	return 0;
+}
+
+// Main function
+typedef struct {
+	const char *command;      // NULL (build and check in one go), "build", "query", "add", "remove", "bench" or "serve"
+	const char *filter_path;  // build output / query, add, remove and serve input
+	const char *rockyou_path;
+	const char *dictionary_path;
+	FilterKind kind;
+	ProbeScheme scheme;
+	Layout layout;
+	int threads;
+	uint64_t size;        // explicit --size, 0 if not given
+	int hash_count;       // explicit --hashes, 0 if not given
+	uint64_t items;       // --items, for sizing from a target FPR or memory budget (first stage for scalable)
+	double fpr;           // --fpr
+	uint64_t memory;      // --memory, in bytes
+	int fingerprint_bits; // --fingerprint for cuckoo and fuse, 0 to pick from --fpr
+	const char *format;         // bench output: json or csv
+	const char *sweep_bits;     // bench: comma-separated values to sweep over, NULL for the defaults
+	const char *sweep_hashes;
+	const char *sweep_threads;  // NULL means 1 and every CPU
+	const char *sweep_keys;
+	const char *listen;         // serve: Unix socket path or HOST:PORT
+	int allow_remote;           // serve: let --listen take a non-loopback address
+	uint64_t sample;            // --sample: estimate the stats from this many queries, 0 for exact
+	const char *remove_path;    // --remove: words to take back out after loading rockyou
+} Options;
+
+void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [build FILTER | query FILTER | add FILTER | remove FILTER | bench | serve [FILTER]]\n"
+		"\t[options]\n"
+		"\t[--filter bloom|scalable|cuckoo|fuse] [--fingerprint 8|16]\n"
+		"\t[--probe seeded|double|enhanced] [--hash md5|xxh64|murmur3|wyhash]\n"
+		"\t[--layout classic|blocked|register|split|counting] [--batch N] [--threads N]\n"
+		"\t[--rockyou PATH] [--dictionary PATH]\n"
+		"\t[--size BITS] [--hashes K] [--items N --fpr P] [--memory BYTES[K|M|G]]\n"
+		"\t[--preset default|high-accuracy] [--pages default|thp|2m|1g] [--prefault]\n"
+		"\t[--numa off|replicate|interleave] [--profile] [--latency]\n"
+		"\t[--output text|bitset|counts|positives] [--sample N] [--remove PATH]\n"
+		"\tbench: [--format json|csv] [--sweep-bits LIST] [--sweep-hashes LIST] [--sweep-threads LIST]\n"
+		"\t       [--sweep-keys short,medium,long] [--items N]\n"
+		"\tserve: [--listen PATH|HOST:PORT] [--allow-remote]\n", prog);
+}
+
+// Parses a count with an optional K/M/G suffix (powers of 1024)
+uint64_t parse_size(const char *text) {
+	char *end;
+	uint64_t value = strtoull(text, &end, 10);
+	switch (*end) {
+	case 'K': case 'k': return value << 10;
+	case 'M': case 'm': return value << 20;
+	case 'G': case 'g': return value << 30;
+	default: return value;
+	}
+}
+
+/*
+ * Works out m and k from the options. Explicit --size/--hashes always win.
+ * Otherwise --items with --fpr gives the textbook optimum
+ * m = -n ln p / (ln 2)^2, k = (m / n) ln 2, and --memory fixes m (in cells,
+ * so a counting filter gets a quarter as many) and still picks the best k
+ * for --items if it was given.
+ */
+void resolve_size(const Options *opts, uint64_t *size, int *hash_count) {
+	*size = DEFAULT_BLOOM_SIZE;
+	*hash_count = DEFAULT_HASH_COUNT;
+
+	if (opts->memory > 0) {
+		*size = opts->memory * 8 / bloom_cell_bits(opts->layout);
+	} else if (opts->items > 0 && opts->fpr > 0) {
+		*size = (uint64_t)ceil(-(double)opts->items * log(opts->fpr) / (M_LN2 * M_LN2));
+	}
+	if (opts->items > 0 && (opts->memory > 0 || opts->fpr > 0)) {
+		*hash_count = (int)round((double)*size / opts->items * M_LN2);
+	}
+
+	if (opts->size > 0) *size = opts->size;
+	if (opts->hash_count > 0) *hash_count = opts->hash_count;
+	if (*hash_count < 1) *hash_count = 1;
+	if (*hash_count > MAX_HASH_COUNT) *hash_count = MAX_HASH_COUNT;
+	if (*size < BLOCK_BITS) *size = BLOCK_BITS;
+}
+
+/*
+ * Sets up whichever filter --filter asked for. A scalable filter starts at
+ * --items (or a million) and grows from there, keeping the whole chain under
+ * --fpr (or 0.1%). A cuckoo filter is sized for --items, or for the number of
+ * lines in input. Cuckoo and fuse fingerprints come from --fingerprint or
+ * --fpr (16 bits if neither is given); a fuse filter sizes itself from the
+ * keys. --size, --hashes and --memory only apply to Bloom filters.
+ */
+void filter_create(Filter *filter, const Options *opts, const LineScanner *input) {
+	filter->kind = opts->kind;
+	int bits = opts->fingerprint_bits;
+	if (bits == 0) {
+		bits = opts->fpr <= 0 ? 16 : opts->kind == FILTER_FUSE ? (opts->fpr >= 1.0 / 256 ? 8 : 16)
+			: cuckoo_fingerprint_bits(opts->fpr);
+	}
+	if (opts->kind == FILTER_CUCKOO) {
+		cuckoo_init(&filter->cuckoo, opts->items > 0 ? opts->items : scanner_count(input), bits);
+		return;
+	}
+	if (opts->kind == FILTER_FUSE) {
+		fuse_init(&filter->fuse, bits);
+		return;
+	}
+	if (opts->kind == FILTER_SCALABLE) {
+		scalable_init(&filter->scalable, opts->items > 0 ? opts->items : SCALABLE_DEFAULT_ITEMS,
+			opts->fpr > 0 ? opts->fpr : SCALABLE_DEFAULT_FPR, opts->scheme, opts->layout);
+		return;
+	}
+
+	uint64_t size;
+	int hash_count;
+	resolve_size(opts, &size, &hash_count);
+	bloom_init(&filter->bloom, size, hash_count, opts->layout);
+	filter->bloom.scheme = opts->scheme;
+}
+
+int parse_options(int argc, char *argv[], Options *opts) {
+	*opts = (Options){NULL, NULL, "rockyou.ISO-8859-1.txt", "dictionary.txt", FILTER_BLOOM, PROBE_SEEDED,
+		LAYOUT_CLASSIC, 1, 0, 0, 0, 0, 0, 0, "json", NULL, NULL, NULL, "short,medium,long",
+		"bloom_filter.sock", 0, 0, NULL};
+
+	int i = 1;
+	if (i + 1 < argc && (strcmp(argv[i], "build") == 0 || strcmp(argv[i], "query") == 0
+			|| strcmp(argv[i], "add") == 0 || strcmp(argv[i], "remove") == 0)) {
+		opts->command = argv[i];
+		opts->filter_path = argv[i + 1];
+		i += 2;
+	} else if (i < argc && strcmp(argv[i], "bench") == 0) {
+		opts->command = argv[i];
+		i++;
+	} else if (i < argc && strcmp(argv[i], "serve") == 0) {
+		// The filter file is optional; without one, serve builds from --rockyou
+		opts->command = argv[i];
+		i++;
+		if (i < argc && strncmp(argv[i], "--", 2) != 0) {
+			opts->filter_path = argv[i++];
+		}
+	}
+
+	for (; i < argc; i++) {
+		if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+			const char *name = argv[++i];
+			if (strcmp(name, "bloom") == 0) opts->kind = FILTER_BLOOM;
+			else if (strcmp(name, "scalable") == 0) opts->kind = FILTER_SCALABLE;
+			else if (strcmp(name, "cuckoo") == 0) opts->kind = FILTER_CUCKOO;
+			else if (strcmp(name, "fuse") == 0) opts->kind = FILTER_FUSE;
+			else {
+				fprintf(stderr, "Unknown filter: %s (use bloom, scalable, cuckoo or fuse)\n", name);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--fingerprint") == 0 && i + 1 < argc) {
+			opts->fingerprint_bits = atoi(argv[++i]);
+			if (opts->fingerprint_bits != 8 && opts->fingerprint_bits != 16) {
+				fprintf(stderr, "Fingerprints must be 8 or 16 bits\n");
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--probe") == 0 && i + 1 < argc) {
+			const char *name = argv[++i];
+			if (strcmp(name, "seeded") == 0) opts->scheme = PROBE_SEEDED;
+			else if (strcmp(name, "double") == 0) opts->scheme = PROBE_DOUBLE;
+			else if (strcmp(name, "enhanced") == 0) opts->scheme = PROBE_ENHANCED;
+			else {
+				fprintf(stderr, "Unknown probe scheme: %s (use seeded, double or enhanced)\n", name);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--hash") == 0 && i + 1 < argc) {
+			hash_engine = find_hash_engine(argv[++i]);
+			if (hash_engine == NULL) {
+				fprintf(stderr, "Unknown hash engine: %s (use md5, xxh64, murmur3 or wyhash)\n", argv[i]);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--layout") == 0 && i + 1 < argc) {
+			const char *name = argv[++i];
+			if (strcmp(name, "classic") == 0) opts->layout = LAYOUT_CLASSIC;
+			else if (strcmp(name, "blocked") == 0) opts->layout = LAYOUT_BLOCKED;
+			else if (strcmp(name, "register") == 0) opts->layout = LAYOUT_REGISTER;
+			else if (strcmp(name, "split") == 0) opts->layout = LAYOUT_SPLIT;
+			else if (strcmp(name, "counting") == 0) opts->layout = LAYOUT_COUNTING;
+			else {
+				fprintf(stderr, "Unknown layout: %s (use classic, blocked, register, split or counting)\n", name);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+			batch_window = atoi(argv[++i]);
+			if (batch_window < 1 || batch_window > MAX_BATCH_WINDOW) {
+				fprintf(stderr, "Batch window must be between 1 and %d\n", MAX_BATCH_WINDOW);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			opts->threads = atoi(argv[++i]);
+			if (opts->threads < 1) {
+				fprintf(stderr, "Thread count must be at least 1\n");
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+			opts->size = parse_size(argv[++i]);
+		} else if (strcmp(argv[i], "--hashes") == 0 && i + 1 < argc) {
+			opts->hash_count = atoi(argv[++i]);
+			if (opts->hash_count < 1 || opts->hash_count > MAX_HASH_COUNT) {
+				fprintf(stderr, "Hash count must be between 1 and %d\n", MAX_HASH_COUNT);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--items") == 0 && i + 1 < argc) {
+			opts->items = parse_size(argv[++i]);
+		} else if (strcmp(argv[i], "--fpr") == 0 && i + 1 < argc) {
+			opts->fpr = atof(argv[++i]);
+			if (opts->fpr <= 0 || opts->fpr >= 1) {
+				fprintf(stderr, "Target FPR must be between 0 and 1\n");
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--memory") == 0 && i + 1 < argc) {
+			opts->memory = parse_size(argv[++i]);
+			if (opts->memory > MAX_BLOOM_SIZE / 8) {
+				fprintf(stderr, "Memory budget is too big (at most %llu bytes)\n", (unsigned long long)(MAX_BLOOM_SIZE / 8));
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--preset") == 0 && i + 1 < argc) {
+			const char *name = argv[++i];
+			if (strcmp(name, "default") == 0) {
+				opts->size = DEFAULT_BLOOM_SIZE;
+				opts->hash_count = DEFAULT_HASH_COUNT;
+			} else if (strcmp(name, "high-accuracy") == 0) {
+				opts->size = 481221388;
+				opts->hash_count = 23;
+			} else {
+				fprintf(stderr, "Unknown preset: %s (use default or high-accuracy)\n", name);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--pages") == 0 && i + 1 < argc) {
+			const char *name = argv[++i];
+			if (strcmp(name, "default") == 0) page_policy = PAGES_DEFAULT;
+			else if (strcmp(name, "thp") == 0) page_policy = PAGES_THP;
+			else if (strcmp(name, "2m") == 0) page_policy = PAGES_HUGE_2M;
+			else if (strcmp(name, "1g") == 0) page_policy = PAGES_HUGE_1G;
+			else {
+				fprintf(stderr, "Unknown page policy: %s (use default, thp, 2m or 1g)\n", name);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--numa") == 0 && i + 1 < argc) {
+			const char *name = argv[++i];
+			if (strcmp(name, "off") == 0) numa_mode = NUMA_OFF;
+			else if (strcmp(name, "replicate") == 0) numa_mode = NUMA_REPLICATE;
+			else if (strcmp(name, "interleave") == 0) numa_mode = NUMA_INTERLEAVE;
+			else {
+				fprintf(stderr, "Unknown NUMA mode: %s (use off, replicate or interleave)\n", name);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+			const char *name = argv[++i];
+			if (strcmp(name, "text") == 0) output_mode = OUTPUT_TEXT;
+			else if (strcmp(name, "bitset") == 0) output_mode = OUTPUT_BITSET;
+			else if (strcmp(name, "counts") == 0) output_mode = OUTPUT_COUNTS;
+			else if (strcmp(name, "positives") == 0) output_mode = OUTPUT_POSITIVES;
+			else {
+				fprintf(stderr, "Unknown output: %s (use text, bitset, counts or positives)\n", name);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+			opts->sample = parse_size(argv[++i]);
+			if (opts->sample == 0) {
+				fprintf(stderr, "Sample size must be at least 1\n");
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--remove") == 0 && i + 1 < argc) {
+			opts->remove_path = argv[++i];
+		} else if (strcmp(argv[i], "--latency") == 0) {
+			latency_tracking = 1;
+		} else if (strcmp(argv[i], "--profile") == 0) {
+			profiling = 1;
+		} else if (strcmp(argv[i], "--prefault") == 0) {
+			page_prefault = 1;
+		} else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+			opts->format = argv[++i];
+			if (strcmp(opts->format, "json") != 0 && strcmp(opts->format, "csv") != 0) {
+				fprintf(stderr, "Unknown format: %s (use json or csv)\n", opts->format);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--sweep-bits") == 0 && i + 1 < argc) {
+			opts->sweep_bits = argv[++i];
+		} else if (strcmp(argv[i], "--sweep-hashes") == 0 && i + 1 < argc) {
+			opts->sweep_hashes = argv[++i];
+		} else if (strcmp(argv[i], "--sweep-threads") == 0 && i + 1 < argc) {
+			opts->sweep_threads = argv[++i];
+		} else if (strcmp(argv[i], "--sweep-keys") == 0 && i + 1 < argc) {
+			opts->sweep_keys = argv[++i];
+		} else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+			opts->listen = argv[++i];
+		} else if (strcmp(argv[i], "--allow-remote") == 0) {
+			opts->allow_remote = 1;
+		} else if (strcmp(argv[i], "--rockyou") == 0 && i + 1 < argc) {
+			opts->rockyou_path = argv[++i];
+		} else if (strcmp(argv[i], "--dictionary") == 0 && i + 1 < argc) {
+			opts->dictionary_path = argv[++i];
+		} else {
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// build: load rockyou into a filter and write it out, no exact-match table
+int run_build(const Options *opts) {
+	if (opts->kind != FILTER_BLOOM) {
+		fprintf(stderr, "Only --filter bloom can be saved to a file\n");
+		return 1;
+	}
+	LineScanner rockyou;
+	if (scanner_open(&rockyou, opts->rockyou_path) < 0) {
+		fprintf(stderr, "Failed to open %s\n", opts->rockyou_path);
+		return 1;
+	}
+	Filter filter;
+	filter_create(&filter, opts, &rockyou);
+	load_corpus(&filter, &rockyou, opts->threads, 0);
+	scanner_close(&rockyou);
+	filter_report(&filter);
+
+	int status = 0;
+	if (bloom_save(&filter.bloom, opts->filter_path) < 0) {
+		fprintf(stderr, "Failed to write %s\n", opts->filter_path);
+		status = 1;
+	}
+	filter_free(&filter);
+	return status;
+}
+
+// query: map a saved filter and answer the dictionary; no ground truth, so stats only with --sample
+int run_query(const Options *opts) {
+	Filter filter = {.kind = FILTER_BLOOM};
+	if (bloom_load(&filter.bloom, opts->filter_path, 0) < 0) {
+		return 1;
+	}
+
+	LineScanner dictionary;
+	if (scanner_open(&dictionary, opts->dictionary_path) < 0) {
+		fprintf(stderr, "Failed to open %s\n", opts->dictionary_path);
+		filter_free(&filter);
+		return 1;
+	}
+	Results results = {0};
+	run_queries(&filter, &dictionary, opts->threads, 0, &results);
+
+	// With --sample, check the filter against --rockyou without loading all of it into memory
+	int status = 0;
+	if (opts->sample > 0) {
+		LineScanner rockyou;
+		if (scanner_open(&rockyou, opts->rockyou_path) < 0) {
+			fprintf(stderr, "Failed to open %s\n", opts->rockyou_path);
+			status = 1;
+		} else {
+			sample_results(&filter, &dictionary, &rockyou, opts->sample, stderr);
+			scanner_close(&rockyou);
+		}
+	}
+	scanner_close(&dictionary);
+	filter_free(&filter);
+	return status;
+}
+
+/*
+ * add/remove: edit a saved filter in place with the words in --dictionary,
+ * so a blocklist change doesn't need a rebuild. Removing needs --layout counting.
+ */
+int run_edit(const Options *opts) {
+	int removing = strcmp(opts->command, "remove") == 0;
+	BloomFilter filter;
+	if (bloom_load(&filter, opts->filter_path, 1) < 0) {
+		return 1;
+	}
+	if (removing && filter.layout != LAYOUT_COUNTING) {
+		fprintf(stderr, "%s wasn't built with --layout counting, so words can't be removed\n", opts->filter_path);
+		bloom_free(&filter);
+		return 1;
+	}
+
+	LineScanner words;
+	if (scanner_open(&words, opts->dictionary_path) < 0) {
+		fprintf(stderr, "Failed to open %s\n", opts->dictionary_path);
+		bloom_free(&filter);
+		return 1;
+	}
+	uint64_t changed = 0, missing = 0;
+	Key word;
+	while (scanner_next(&words, &word)) {
+		if (!removing) {
+			bloom_add(&filter, word.str, word.len);
+			changed++;
+		} else if (bloom_remove(&filter, word.str, word.len) > 0) {
+			changed++;
+		} else {
+			missing++;
+		}
+	}
+	scanner_close(&words);
+
+	int status = 0;
+	if (bloom_sync(&filter) != 0) {
+		fprintf(stderr, "Failed to write %s\n", opts->filter_path);
+		status = 1;
+	}
+	fprintf(stderr, "%s %llu words", removing ? "Removed" : "Added", (unsigned long long)changed);
+	if (removing) {
+		fprintf(stderr, " (%llu weren't in the filter)", (unsigned long long)missing);
+	}
+	fprintf(stderr, "\n");
+	bloom_report(&filter);
+	bloom_free(&filter);
+	return status;
+}
+
+/*
+ * bench: for every combination of --sweep-keys, --sweep-bits (bits per key),
+ * --sweep-hashes (k) and --sweep-threads, build a filter from --items
+ * synthetic keys and time the build, a lookup of every inserted key and a
+ * lookup of as many keys that were never inserted. The other flags (--filter,
+ * --hash, --probe, --layout, --batch, --pages) apply to every run. Times are
+ * wall clock, so with several threads ns per key is really 1 / throughput.
+ * Results go to stdout as JSON or CSV; progress goes to stderr.
+ */
+int run_bench(const Options *opts) {
+	static const char *filter_names[] = {"bloom", "scalable", "cuckoo", "fuse"};
+	static const char *layout_names[] = {"classic", "blocked", "register", "split", "counting"};
+	static const char *probe_names[] = {"seeded", "double", "enhanced"};
+	int bits[64], hashes[64], threads[64];
+	int bits_count = parse_list(opts->sweep_bits ? opts->sweep_bits : "8,12,16", bits, 64);
+	int hashes_count = parse_list(opts->sweep_hashes ? opts->sweep_hashes : "4,7,10", hashes, 64);
+	int threads_count;
+	int shapes[sizeof(key_shapes) / sizeof(key_shapes[0])];
+	if (parse_key_shapes(opts->sweep_keys, shapes) < 0) {
+		return 1;
+	}
+	if (opts->sweep_threads != NULL) {
+		threads_count = parse_list(opts->sweep_threads, threads, 64);
+	} else {
+		threads[0] = 1;
+		threads[1] = sysconf(_SC_NPROCESSORS_ONLN);
+		threads_count = threads[1] > 1 ? 2 : 1;
+	}
+	for (int i = 0; i < bits_count; i++) {
+		if (bits[i] < 1) {
+			fprintf(stderr, "Bits per key must be at least 1\n");
+			return 1;
+		}
+	}
+	for (int i = 0; i < hashes_count; i++) {
+		if (hashes[i] < 0 || hashes[i] > MAX_HASH_COUNT) {
+			fprintf(stderr, "Hash count must be between 0 and %d\n", MAX_HASH_COUNT);
+			return 1;
+		}
+	}
+	for (int i = 0; i < threads_count; i++) {
+		if (threads[i] < 1) {
+			fprintf(stderr, "Thread count must be at least 1\n");
+			return 1;
+		}
+	}
+	if (bits_count == 0 || hashes_count == 0 || threads_count == 0) {
+		fprintf(stderr, "Sweep lists need at least one number\n");
+		return 1;
+	}
+	// The other kinds size themselves and build on one thread, so only the lookups use the thread sweep
+	if (opts->kind != FILTER_BLOOM) {
+		if (opts->sweep_bits != NULL || opts->sweep_hashes != NULL) {
+			fprintf(stderr, "bench: --sweep-bits and --sweep-hashes only apply to --filter bloom\n");
+		}
+		bits_count = hashes_count = 1;
+	}
+	size_t n = opts->items > 0 ? opts->items : BENCH_DEFAULT_ITEMS;
+	int csv = strcmp(opts->format, "csv") == 0;
+
+	if (csv) {
+		printf("filter,layout,hash,probe,keys,items,bits_per_key,k,threads,build_threads,bytes,build_s,"
+			"ns_per_insert,ns_per_positive,ns_per_negative,fpr,false_negatives\n");
+	} else {
+		printf("[");
+	}
+	int runs = 0;
+	for (size_t s = 0; s < sizeof(key_shapes) / sizeof(key_shapes[0]); s++) {
+		const KeyShape *shape = &key_shapes[s];
+		if (!shapes[s]) {
+			continue;
+		}
+		size_t positive_size, negative_size;
+		char *positive_text = bench_keys(n, shape, 'p', 1, &positive_size);
+		char *negative_text = bench_keys(n, shape, 'n', 2, &negative_size);
+		Key *positives = malloc(n * sizeof(Key)), *negatives = malloc(n * sizeof(Key));
+		if (positives == NULL || negatives == NULL) {
+			fprintf(stderr, "Failed to allocate memory for benchmark keys\n");
+			exit(1);
+		}
+		LineScanner scanner = {positive_text, positive_size, 0};
+		for (size_t i = 0; scanner_next(&scanner, &positives[i]); i++) {}
+		scanner = (LineScanner){negative_text, negative_size, 0};
+		for (size_t i = 0; scanner_next(&scanner, &negatives[i]); i++) {}
+
+		for (int b = 0; b < bits_count; b++) {
+			for (int h = 0; h < hashes_count; h++) {
+				for (int t = 0; t < threads_count; t++) {
+					Options run = *opts;
+					run.size = (uint64_t)bits[b] * n;
+					// k of 0 means the best k for the size, (m / n) ln 2
+					run.hash_count = hashes[h] > 0 ? hashes[h] : (int)round(bits[b] * M_LN2);
+					if (run.hash_count < 1) run.hash_count = 1;
+					if (run.hash_count > MAX_HASH_COUNT) run.hash_count = MAX_HASH_COUNT;
+					run.items = n;
+					Filter filter;
+					LineScanner input = {positive_text, positive_size, 0};
+					filter_create(&filter, &run, &input);
+
+					double start = now_seconds();
+					load_corpus(&filter, &input, threads[t], 0);
+					double build = now_seconds() - start;
+					uint64_t found, false_positives;
+					double positive = bench_lookups(&filter, positives, n, threads[t], &found);
+					double negative = bench_lookups(&filter, negatives, n, threads[t], &false_positives);
+
+					FilterArray arrays[MAX_STAGES];
+					size_t bytes = 0;
+					int count = filter_arrays(&filter, arrays);
+					for (int i = 0; i < count; i++) {
+						bytes += arrays[i].bytes;
+					}
+					filter_free(&filter);
+
+					/*
+					 * Report what the run really used: bits per key from the memory the filter
+					 * took, no k (0) for the kinds without one, and one build thread for
+					 * everything but a plain Bloom filter.
+					 */
+					int bloom = run.kind == FILTER_BLOOM;
+					int build_threads = bloom ? threads[t] : 1;
+					// Both formats take the same fields; JSON rows start with the separator from the row before
+					const char *row = csv ? "%s%s,%s,%s,%s,%s,%zu,%.2f,%d,%d,%d,%zu,%.6f,%.2f,%.2f,%.2f,%.6g,%llu\n"
+						: "%s\n  {\"filter\": \"%s\", \"layout\": \"%s\", \"hash\": \"%s\", \"probe\": \"%s\", "
+						"\"keys\": \"%s\", \"items\": %zu, \"bits_per_key\": %.2f, \"k\": %d, \"threads\": %d, "
+						"\"build_threads\": %d, \"bytes\": %zu, \"build_s\": %.6f, \"ns_per_insert\": %.2f, "
+						"\"ns_per_positive\": %.2f, \"ns_per_negative\": %.2f, \"fpr\": %.6g, \"false_negatives\": %llu}";
+					printf(row, csv || runs == 0 ? "" : ",", filter_names[run.kind], layout_names[run.layout],
+						hash_engine->name, probe_names[run.scheme], shape->name, n, bytes * 8.0 / n,
+						bloom ? run.hash_count : 0, threads[t], build_threads, bytes, build, build * 1e9 / n,
+						positive * 1e9 / n, negative * 1e9 / n, (double)false_positives / n,
+						(unsigned long long)(n - found));
+					fflush(stdout);
+					runs++;
+					fprintf(stderr, "bench: %s keys, %.1f bits/key, k=%d, %d threads: %.1f ns/insert, %.1f ns/query\n",
+						shape->name, bytes * 8.0 / n, bloom ? run.hash_count : 0, threads[t], build * 1e9 / n,
+						negative * 1e9 / n);
+				}
+			}
+		}
+		free(positive_text);
+		free(negative_text);
+		free(positives);
+		free(negatives);
+	}
+	if (!csv) {
+		printf("\n]\n");
+	}
+	return 0;
+}
+
+/*
+ * serve: answer lookups over --listen until SIGINT/SIGTERM. The filter is
+ * mapped from FILTER if one was given, or built from --rockyou (any --filter
+ * kind) otherwise.
+ */
+int run_serve(const Options *opts) {
+	Filter filter;
+	if (opts->filter_path != NULL) {
+		filter.kind = FILTER_BLOOM;
+		if (bloom_load(&filter.bloom, opts->filter_path, 0) < 0) {
+			return 1;
+		}
+	} else {
+		LineScanner rockyou;
+		if (scanner_open(&rockyou, opts->rockyou_path) < 0) {
+			fprintf(stderr, "Failed to open %s\n", opts->rockyou_path);
+			return 1;
+		}
+		filter_create(&filter, opts, &rockyou);
+		load_corpus(&filter, &rockyou, opts->threads, 0);
+		scanner_close(&rockyou);
+	}
+	filter_report(&filter);
+
+	int listen_fd = serve_listen(opts->listen, opts->allow_remote);
+	if (listen_fd < 0) {
+		filter_free(&filter);
+		return 1;
+	}
+	fprintf(stderr, "Listening on %s\n", opts->listen);
+	int status = serve_loop(&filter, listen_fd) < 0;
+	close(listen_fd);
+	if (strchr(opts->listen, ':') == NULL) {
+		unlink_socket(opts->listen);
+	}
+	filter_free(&filter);
+	return status;
+}
+
+int main(int argc, char *argv[]) {
+	Options opts;
+	if (parse_options(argc, argv, &opts) < 0) {
+		return 1;
+	}
+	if (opts.command != NULL && strcmp(opts.command, "build") == 0) {
+		return run_build(&opts);
+	}
+	if (opts.command != NULL && strcmp(opts.command, "query") == 0) {
+		return run_query(&opts);
+	}
+	if (opts.command != NULL && strcmp(opts.command, "bench") == 0) {
+		return run_bench(&opts);
+	}
+	if (opts.command != NULL && strcmp(opts.command, "serve") == 0) {
+		return run_serve(&opts);
+	}
+	if (opts.command != NULL) {
+		return run_edit(&opts);
+	}
+
+	Results results = {0};
+	int exact = opts.sample == 0;  // with --sample, no exact-match table
+	if (opts.remove_path != NULL && !(opts.kind == FILTER_CUCKOO
+			|| (opts.kind == FILTER_BLOOM && opts.layout == LAYOUT_COUNTING))) {
+		fprintf(stderr, "--remove needs --filter cuckoo or --layout counting\n");
+		return 1;
+	}
+	if (opts.remove_path != NULL && !exact) {
+		fprintf(stderr, "--remove needs the exact-match table, so it can't be used with --sample\n");
+		return 1;
+	}
+
+	// Load rockyou.txt into Bloom filter and hash table
+	LineScanner rockyou;
+	if (scanner_open(&rockyou, opts.rockyou_path) < 0) {
+		fprintf(stderr, "Failed to open %s\n", opts.rockyou_path);
+		return 1;
+	}
+	Filter filter;
+	filter_create(&filter, &opts, &rockyou);
+	if (exact) {
+		init_word_set();
+	}
+	load_corpus(&filter, &rockyou, opts.threads, exact);
+	if (opts.remove_path != NULL && remove_corpus(&filter, opts.remove_path) < 0) {
+		scanner_close(&rockyou);
+		filter_free(&filter);
+		free_word_set();
+		return 1;
+	}
+	filter_report(&filter);
+	if (exact) {
+		word_set_report();
+	}
+
+	// Process dictionary.txt
+	LineScanner dictionary;
+	if (scanner_open(&dictionary, opts.dictionary_path) < 0) {
+		fprintf(stderr, "Failed to open %s\n", opts.dictionary_path);
+		scanner_close(&rockyou);
+		filter_free(&filter);
+		if (exact) {
+			free_word_set();
+		}
+		return 1;
+	}
+	run_queries(&filter, &dictionary, opts.threads, exact, &results);
+
+	// Print statistics (to stderr with the other --output formats, so stdout is only the results)
+	FILE *stats = output_mode == OUTPUT_TEXT ? stdout : stderr;
+	if (exact) {
+		fprintf(stats, "True Positives: %d\n", results.true_positive);
+		fprintf(stats, "True Negatives: %d\n", results.true_negative);
+		fprintf(stats, "False Positives: %d\n", results.false_positive);
+		fprintf(stats, "False Negatives: %d\n", results.false_negative);
+	} else {
+		sample_results(&filter, &dictionary, &rockyou, opts.sample, stats);
+	}
+	scanner_close(&dictionary);
+	scanner_close(&rockyou);
+
+	// Clean up! Clean up! Everybody, Everywhere!
+	// Clean up! Clean up! Everybody do your share!
+	filter_free(&filter);
+	if (exact) {
+		free_word_set();
+	}
 
 	return 0;
 }
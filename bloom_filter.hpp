@@ -0,0 +1,184 @@
+#ifndef BLOOM_FILTER_HPP
+#define BLOOM_FILTER_HPP
+
+/*
+ * Header-only C++ version of the filter for embedding in other programs.
+ *
+ * BloomFilter<Bits, K, Hash> has its size and hash count baked in at compile
+ * time, the same as the old #define BLOOM_SIZE / HASH_COUNT build: the K
+ * probes are unrolled and the range reduction is a multiply by a constant.
+ * make_filter(bits, k) hands back one of the pre-instantiated presets when
+ * (bits, k) matches, and a RuntimeBloomFilter otherwise.
+ *
+ * Bits are laid out exactly like `bloom_filter --probe double --layout classic`
+ * with the matching --hash engine, so data() can be written to or filled from
+ * the bit array of a filter file.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <utility>
+
+#include "hash_engines.h"
+
+namespace bloom {
+
+// Hash policies: hash(key, len, out) fills out[2] with 128 bits
+struct Wyhash {
+	static void hash(const void *key, size_t len, uint64_t out[2]) { hash_wyhash(key, len, 0, out); }
+};
+
+struct Xxh64 {
+	static void hash(const void *key, size_t len, uint64_t out[2]) { hash_xxh64(key, len, 0, out); }
+};
+
+struct Murmur3 {
+	static void hash(const void *key, size_t len, uint64_t out[2]) { hash_murmur3(key, len, 0, out); }
+};
+
+constexpr int max_hash_count = 32;
+
+// Lemire's fastrange: maps h onto [0, n) without a division
+constexpr uint64_t fastrange64(uint64_t h, uint64_t n) {
+	return (uint64_t)(((__uint128_t)h * n) >> 64);
+}
+
+// Same size as the C bloom_bytes(): one spare byte, rounded up to cache lines
+constexpr size_t array_bytes(uint64_t bits) {
+	return (bits / 8 + 1 + 63) & ~(size_t)63;
+}
+
+// What the factory returns, so callers don't need to know which specialization they got
+class Filter {
+public:
+	virtual ~Filter() = default;
+	virtual void add(std::string_view key) = 0;
+	virtual bool check(std::string_view key) const = 0;
+	virtual uint64_t bits() const = 0;
+	virtual int hash_count() const = 0;
+	virtual unsigned char *data() = 0;
+	virtual size_t size_bytes() const = 0;
+};
+
+// Owns a zeroed, cache-line aligned bit array
+class BitArray {
+public:
+	explicit BitArray(size_t bytes)
+		: bytes_(bytes), words_(static_cast<uint64_t *>(::operator new[](bytes, std::align_val_t(64)))) {
+		std::memset(words_, 0, bytes);
+	}
+	~BitArray() { ::operator delete[](words_, std::align_val_t(64)); }
+	BitArray(const BitArray &) = delete;
+	BitArray &operator=(const BitArray &) = delete;
+
+	void set(uint64_t index) { words_[index / 64] |= 1ULL << (index % 64); }
+	bool test(uint64_t index) const { return words_[index / 64] & (1ULL << (index % 64)); }
+	unsigned char *data() { return reinterpret_cast<unsigned char *>(words_); }
+	size_t size_bytes() const { return bytes_; }
+
+private:
+	size_t bytes_;
+	uint64_t *words_;
+};
+
+template <uint64_t Bits, int K, typename Hash = Wyhash>
+class BloomFilter final : public Filter {
+	static_assert(Bits >= 64, "filter needs at least 64 bits");
+	static_assert(K >= 1 && K <= max_hash_count, "hash count out of range");
+
+public:
+	static constexpr uint64_t bit_count = Bits;
+	static constexpr int probe_count = K;
+
+	BloomFilter() : array_(array_bytes(Bits)) {}
+
+	void add(std::string_view key) override {
+		uint64_t h[2];
+		Hash::hash(key.data(), key.size(), h);
+		set_all(h[0], h[1], std::make_integer_sequence<uint64_t, K>());
+	}
+
+	bool check(std::string_view key) const override {
+		uint64_t h[2];
+		Hash::hash(key.data(), key.size(), h);
+		return test_all(h[0], h[1], std::make_integer_sequence<uint64_t, K>());
+	}
+
+	uint64_t bits() const override { return Bits; }
+	int hash_count() const override { return K; }
+	unsigned char *data() override { return array_.data(); }
+	size_t size_bytes() const override { return array_.size_bytes(); }
+
+private:
+	// Probe I is h1 + I*h2, the same double hashing as the C --probe double
+	template <uint64_t... I>
+	void set_all(uint64_t h1, uint64_t h2, std::integer_sequence<uint64_t, I...>) {
+		(array_.set(fastrange64(h1 + I * h2, Bits)), ...);
+	}
+
+	template <uint64_t... I>
+	bool test_all(uint64_t h1, uint64_t h2, std::integer_sequence<uint64_t, I...>) const {
+		return (array_.test(fastrange64(h1 + I * h2, Bits)) && ...);
+	}
+
+	BitArray array_;
+};
+
+// Fallback when (bits, k) isn't one of the presets
+template <typename Hash = Wyhash>
+class RuntimeBloomFilter final : public Filter {
+public:
+	RuntimeBloomFilter(uint64_t bits, int k) : bits_(bits), k_(k), array_(array_bytes(bits)) {}
+
+	void add(std::string_view key) override {
+		uint64_t h[2];
+		Hash::hash(key.data(), key.size(), h);
+		for (int i = 0; i < k_; i++) {
+			array_.set(fastrange64(h[0] + i * h[1], bits_));
+		}
+	}
+
+	bool check(std::string_view key) const override {
+		uint64_t h[2];
+		Hash::hash(key.data(), key.size(), h);
+		for (int i = 0; i < k_; i++) {
+			if (!array_.test(fastrange64(h[0] + i * h[1], bits_))) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	uint64_t bits() const override { return bits_; }
+	int hash_count() const override { return k_; }
+	unsigned char *data() override { return array_.data(); }
+	size_t size_bytes() const override { return array_.size_bytes(); }
+
+private:
+	uint64_t bits_;
+	int k_;
+	BitArray array_;
+};
+
+// The README's default and high-accuracy settings, plus two power-of-two sizes
+using DefaultFilter = BloomFilter<206237738, 10>;
+using HighAccuracyFilter = BloomFilter<481221388, 23>;
+using Filter128M = BloomFilter<(1ULL << 27), 7>;
+using Filter1G = BloomFilter<(1ULL << 30), 10>;
+
+template <typename Hash = Wyhash>
+std::unique_ptr<Filter> make_filter(uint64_t bits, int k) {
+	if (bits == 206237738 && k == 10) return std::make_unique<BloomFilter<206237738, 10, Hash>>();
+	if (bits == 481221388 && k == 23) return std::make_unique<BloomFilter<481221388, 23, Hash>>();
+	if (bits == (1ULL << 27) && k == 7) return std::make_unique<BloomFilter<(1ULL << 27), 7, Hash>>();
+	if (bits == (1ULL << 30) && k == 10) return std::make_unique<BloomFilter<(1ULL << 30), 10, Hash>>();
+	if (k < 1 || k > max_hash_count || bits < 64) return nullptr;
+	return std::make_unique<RuntimeBloomFilter<Hash>>(bits, k);
+}
+
+}  // namespace bloom
+
+#endif
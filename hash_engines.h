@@ -0,0 +1,243 @@
+#ifndef HASH_ENGINES_H
+#define HASH_ENGINES_H
+
+/*
+ * The non-cryptographic hash engines (XXH64, MurmurHash3 x64 128, wyhash),
+ * shared by bloom_filter.c and bloom_filter.hpp. Every engine fills out[2]
+ * with 128 bits for (key, seed); the 64-bit ones stretch their result into
+ * the second word with a splitmix64 finalizer.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t mix64(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+	acc += input * XXH_P2;
+	acc = rotl64(acc, 31);
+	return acc * XXH_P1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+	acc ^= xxh64_round(0, val);
+	return acc * XXH_P1 + XXH_P4;
+}
+
+static inline uint64_t xxh64(const void *key, size_t len, uint64_t seed) {
+	const uint8_t *p = (const uint8_t *)key;
+	const uint8_t *end = p + len;
+	uint64_t h;
+
+	if (len >= 32) {
+		uint64_t v1 = seed + XXH_P1 + XXH_P2;
+		uint64_t v2 = seed + XXH_P2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - XXH_P1;
+		do {
+			v1 = xxh64_round(v1, read64(p));
+			v2 = xxh64_round(v2, read64(p + 8));
+			v3 = xxh64_round(v3, read64(p + 16));
+			v4 = xxh64_round(v4, read64(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxh64_merge(h, v1);
+		h = xxh64_merge(h, v2);
+		h = xxh64_merge(h, v3);
+		h = xxh64_merge(h, v4);
+	} else {
+		h = seed + XXH_P5;
+	}
+
+	h += len;
+	while (p + 8 <= end) {
+		h ^= xxh64_round(0, read64(p));
+		h = rotl64(h, 27) * XXH_P1 + XXH_P4;
+		p += 8;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t)read32(p) * XXH_P1;
+		h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+	}
+	while (p < end) {
+		h ^= (*p++) * XXH_P5;
+		h = rotl64(h, 11) * XXH_P1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+static inline void hash_xxh64(const void *key, size_t len, uint32_t seed, uint64_t out[2]) {
+	out[0] = xxh64(key, len, seed);
+	out[1] = mix64(out[0] + XXH_P1);
+}
+
+static inline uint64_t fmix64(uint64_t k) {
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+// MurmurHash3_x64_128, straight from the reference implementation
+static inline void hash_murmur3(const void *key, size_t len, uint32_t seed, uint64_t out[2]) {
+	const uint8_t *data = (const uint8_t *)key;
+	const size_t nblocks = len / 16;
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	uint64_t h1 = seed;
+	uint64_t h2 = seed;
+
+	for (size_t i = 0; i < nblocks; i++) {
+		uint64_t k1 = read64(data + i * 16);
+		uint64_t k2 = read64(data + i * 16 + 8);
+
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	const uint8_t *tail = data + nblocks * 16;
+	uint64_t k1 = 0;
+	uint64_t k2 = 0;
+	switch (len & 15) {
+	case 15: k2 ^= (uint64_t)tail[14] << 48; // fallthrough
+	case 14: k2 ^= (uint64_t)tail[13] << 40; // fallthrough
+	case 13: k2 ^= (uint64_t)tail[12] << 32; // fallthrough
+	case 12: k2 ^= (uint64_t)tail[11] << 24; // fallthrough
+	case 11: k2 ^= (uint64_t)tail[10] << 16; // fallthrough
+	case 10: k2 ^= (uint64_t)tail[9] << 8;   // fallthrough
+	case 9:  k2 ^= (uint64_t)tail[8];
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		// fallthrough
+	case 8:  k1 ^= (uint64_t)tail[7] << 56; // fallthrough
+	case 7:  k1 ^= (uint64_t)tail[6] << 48; // fallthrough
+	case 6:  k1 ^= (uint64_t)tail[5] << 40; // fallthrough
+	case 5:  k1 ^= (uint64_t)tail[4] << 32; // fallthrough
+	case 4:  k1 ^= (uint64_t)tail[3] << 24; // fallthrough
+	case 3:  k1 ^= (uint64_t)tail[2] << 16; // fallthrough
+	case 2:  k1 ^= (uint64_t)tail[1] << 8;  // fallthrough
+	case 1:  k1 ^= (uint64_t)tail[0];
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+	}
+
+	h1 ^= len;
+	h2 ^= len;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+	h1 += h2;
+	h2 += h1;
+	out[0] = h1;
+	out[1] = h2;
+}
+
+static const uint64_t wyp[4] = {
+	0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+	0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+static inline void wymum(uint64_t *a, uint64_t *b) {
+	__uint128_t r = (__uint128_t)*a * *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t wymix(uint64_t a, uint64_t b) {
+	wymum(&a, &b);
+	return a ^ b;
+}
+
+static inline uint64_t wyr3(const uint8_t *p, size_t k) {
+	return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+// wyhash final4
+static inline uint64_t wyhash(const void *key, size_t len, uint64_t seed) {
+	const uint8_t *p = (const uint8_t *)key;
+	uint64_t a, b;
+
+	seed ^= wymix(seed ^ wyp[0], wyp[1]);
+	if (len <= 16) {
+		if (len >= 4) {
+			a = ((uint64_t)read32(p) << 32) | read32(p + ((len >> 3) << 2));
+			b = ((uint64_t)read32(p + len - 4) << 32) | read32(p + len - 4 - ((len >> 3) << 2));
+		} else if (len > 0) {
+			a = wyr3(p, len);
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		size_t i = len;
+		if (i >= 48) {
+			uint64_t see1 = seed, see2 = seed;
+			do {
+				seed = wymix(read64(p) ^ wyp[1], read64(p + 8) ^ seed);
+				see1 = wymix(read64(p + 16) ^ wyp[2], read64(p + 24) ^ see1);
+				see2 = wymix(read64(p + 32) ^ wyp[3], read64(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i >= 48);
+			seed ^= see1 ^ see2;
+		}
+		while (i > 16) {
+			seed = wymix(read64(p) ^ wyp[1], read64(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = read64(p + i - 16);
+		b = read64(p + i - 8);
+	}
+	a ^= wyp[1];
+	b ^= seed;
+	wymum(&a, &b);
+	return wymix(a ^ wyp[0] ^ len, b ^ wyp[1]);
+}
+
+static inline void hash_wyhash(const void *key, size_t len, uint32_t seed, uint64_t out[2]) {
+	out[0] = wyhash(key, len, seed);
+	out[1] = mix64(out[0] + wyp[2]);
+}
+
+#endif